@@ -7,12 +7,14 @@
 #include <vector>
 #include <queue>
 #include <tucano/mesh.hpp>
-#include <time.h>
+#include <chrono>
+#include "SceneGeometry.hpp"
+#include "ScratchArena.hpp"
+#include "ThreadPool.hpp"
 
 class AccelerationStructure {
-	std::queue<Box> waitingList;
 	std::vector<Box> boxes;
-	Tucano::Mesh mesh;
+	const SceneGeometry* geometry = nullptr;	// the scene's triangles, only read while building
 	int maxFacesPerBox;
 	float maxOverlap;
 	float computedOverlap;
@@ -20,100 +22,129 @@ class AccelerationStructure {
 public:
 	AccelerationStructure() {}
 
-	AccelerationStructure(Tucano::Mesh &_mesh, int _maxFacesPerBox, float _maxOverlap)
+	/*
+	Build the structure over the triangles of the geometry (in world space), the boxes of one level
+	are split in parallel on the pool (if given)
+	*/
+	AccelerationStructure(const SceneGeometry& _geometry, int _maxFacesPerBox, float _maxOverlap, ThreadPool* pool = nullptr)
 	{
-		this->mesh = _mesh;
+		this->geometry = &_geometry;
 		this->maxFacesPerBox = _maxFacesPerBox;
 		this->maxOverlap = _maxOverlap;
 		this->computedOverlap = 0;
-		waitingList.push(Box::generateBoundingBox(mesh));
 		std::cout << std::endl << "<CALCULATING ACCELERATION STRUCTURE>" << std::endl;
 		std::cout << "Max overlap allowed: " << maxOverlap * 100 << "%" << std::endl;
-		clock_t timeStart = clock();
-		split();
-		clock_t timeEnd = clock();
-		std::cout << "Accelleration structure: 100% | Splitting time: " << (float)((timeEnd - timeStart) / CLOCKS_PER_SEC) << " seconds" << std::endl;
+		auto timeStart = std::chrono::steady_clock::now();
+		split(Box::generateBoundingBox(*geometry), pool);
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - timeStart).count();
+		std::cout << "Accelleration structure: 100% | Splitting time: " << seconds << " seconds" << std::endl;
 		std::cout << "Total Bounding boxes created: " << boxes.size() << std::endl;
 		std::cout << "Max overlap: " << computedOverlap * 100 << "%" << std::endl;
 	}
 
-	void split() {
-		
-		Box primary;
-		
+	// Outcome of splitting a single box
+	struct SplitResult {
+		std::vector<Box> waiting;	// boxes that have to be split again
+		std::vector<Box> leaves;	// boxes that are done
+		float overlap = 0;			// overlap of an accepted split
+	};
+
+	/*
+	Split boxes level by level until no box has more than maxFacesPerBox faces.
+	The results of a level are merged in order, so the boxes come out the same
+	as when splitting them one by one from a queue.
+	*/
+	void split(Box root, ThreadPool* pool) {
+		std::vector<Box> waitingList(1, root);
+
 		while (!waitingList.empty()) {
-			primary = waitingList.front();
-			waitingList.pop();
-			if (primary.face_indexs.size() > maxFacesPerBox) {
-				Box b1;
-				Box b2;
-				float midpoint;
-				int axe = primary.getLongestAxe();
-				switch (axe) {
-				case 0: // Split along x
-					midpoint = (primary.max.x() - primary.min.x()) / 2;
-					b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x() - midpoint, primary.max.y(), primary.max.z()));
-					b2 = Box(Eigen::Vector3f(primary.min.x() + midpoint, primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
-					primary.setSplitted(0);
-					break;
-				case 1: // Split along y
-					midpoint = (primary.max.y() - primary.min.y()) / 2;
-					b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y() - midpoint, primary.max.z()));
-					b2 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y() + midpoint, primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
-					primary.setSplitted(1);
-					break;
-				case 2: // Split along z
-					midpoint = (primary.max.z() - primary.min.z()) / 2;
-					b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z() - midpoint));
-					b2 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z() + midpoint), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
-					primary.setSplitted(2);
-					break;
-				case 3: // already splitted on all axis
-					boxes.push_back(primary);
-					continue;
-				default:
-					continue;
-				}
+			std::vector<SplitResult> results(waitingList.size());
+			auto splitOne = [&](int i) { splitBox(waitingList[i], results[i]); };
+			if (pool != nullptr) pool->parallelFor(0, waitingList.size(), splitOne);
+			else for (int i = 0; i < waitingList.size(); i++) splitOne(i);
 
-				for (int i = 0; i < primary.face_indexs.size(); i++) {
-					float d1 = b1.verticesInBox(primary.face_indexs[i], mesh);
-					float d2 = b2.verticesInBox(primary.face_indexs[i], mesh);
-					if (d1 > d2) {
-						b1.addFace(primary.face_indexs[i],  mesh);
-					}
-					else {
-						b2.addFace(primary.face_indexs[i], mesh);
-					}
-				}
+			waitingList.clear();
+			for (SplitResult& r : results) {
+				if (r.overlap > computedOverlap) computedOverlap = r.overlap;
+				boxes.insert(boxes.end(), r.leaves.begin(), r.leaves.end());
+				waitingList.insert(waitingList.end(), r.waiting.begin(), r.waiting.end());
+			}
+		}
+	}
 
-				b1.computeBoundigBox(mesh);
-				b2.computeBoundigBox(mesh);
-				float deltaOverlap = Box::overlapAreaPercent(b1, b2);
-				// we tried to split along one axe but the overlap was too high,
-				// so we push it back into the splitting queue and we change axe
-				// in case the split result of the same size of the parent, push back the
-				// parent because it has updated the splitting axe bool vector.
-				if (deltaOverlap < maxOverlap) {
-					if (deltaOverlap > computedOverlap) computedOverlap = deltaOverlap;
-					if (b1.face_indexs.size() > 0) {
-						if(b1.face_indexs.size() == primary.face_indexs.size()) waitingList.push(primary);
-						else waitingList.push(b1); 
-					}
-					if (b2.face_indexs.size() > 0) { 
-						if (b2.face_indexs.size() == primary.face_indexs.size()) waitingList.push(primary);
-						else waitingList.push(b2);
-					}
+	void splitBox(Box primary, SplitResult& result) {
+		if (primary.face_indexs.size() > maxFacesPerBox) {
+			Box b1;
+			Box b2;
+			float midpoint;
+			int axe = primary.getLongestAxe();
+			switch (axe) {
+			case 0: // Split along x
+				midpoint = (primary.max.x() - primary.min.x()) / 2;
+				b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x() - midpoint, primary.max.y(), primary.max.z()));
+				b2 = Box(Eigen::Vector3f(primary.min.x() + midpoint, primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
+				primary.setSplitted(0);
+				break;
+			case 1: // Split along y
+				midpoint = (primary.max.y() - primary.min.y()) / 2;
+				b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y() - midpoint, primary.max.z()));
+				b2 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y() + midpoint, primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
+				primary.setSplitted(1);
+				break;
+			case 2: // Split along z
+				midpoint = (primary.max.z() - primary.min.z()) / 2;
+				b1 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z()), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z() - midpoint));
+				b2 = Box(Eigen::Vector3f(primary.min.x(), primary.min.y(), primary.min.z() + midpoint), Eigen::Vector3f(primary.max.x(), primary.max.y(), primary.max.z()));
+				primary.setSplitted(2);
+				break;
+			case 3: // already splitted on all axis
+				result.leaves.push_back(primary);
+				return;
+			default:
+				return;
+			}
+
+			for (int i = 0; i < primary.face_indexs.size(); i++) {
+				float d1 = b1.verticesInBox(primary.face_indexs[i], *geometry);
+				float d2 = b2.verticesInBox(primary.face_indexs[i], *geometry);
+				if (d1 > d2) {
+					b1.addFace(primary.face_indexs[i]);
 				}
 				else {
-					waitingList.push(primary);
+					b2.addFace(primary.face_indexs[i]);
+				}
+			}
+
+			b1.computeBoundigBox(*geometry);
+			b2.computeBoundigBox(*geometry);
+			float deltaOverlap = Box::overlapAreaPercent(b1, b2);
+			// we tried to split along one axe but the overlap was too high,
+			// so we push it back into the splitting queue and we change axe
+			// in case the split result of the same size of the parent, push back the
+			// parent because it has updated the splitting axe bool vector.
+			if (deltaOverlap < maxOverlap) {
+				result.overlap = deltaOverlap;
+				if (b1.face_indexs.size() > 0) {
+					if(b1.face_indexs.size() == primary.face_indexs.size()) result.waiting.push_back(primary);
+					else result.waiting.push_back(b1); 
+				}
+				if (b2.face_indexs.size() > 0) { 
+					if (b2.face_indexs.size() == primary.face_indexs.size()) result.waiting.push_back(primary);
+					else result.waiting.push_back(b2);
 				}
-				
 			}
 			else {
-				boxes.push_back(primary);
+				result.waiting.push_back(primary);
 			}
+			
+		}
+		else {
+			result.leaves.push_back(primary);
 		}
 	}
+	// The leaves, every face is in one of them
+	const std::vector<Box>& getBoxes() const { return boxes; }
+
 	vector<Tucano::Shapes::Box> getBoxMesh() {
 		vector<Tucano::Shapes::Box> result;
 		for (int i = 0; i < this->boxes.size(); i++) {
@@ -126,18 +157,6 @@ public:
 		return result;
 	}
 
-	vector<int> intersectAccelStruct(Eigen::Vector3f rayDirection, Eigen::Vector3f origin) {
-		vector<int> faces;
-		for (Box b : boxes) {
-			if (b.intersect(rayDirection, origin)) {
-				for (int face : b.face_indexs) {
-					faces.push_back(face);
-				}
-			}
-		}
-		return faces;
-	}
-
 };
 
 #endif // ACCELERATIONSTRUCTURE
\ No newline at end of file
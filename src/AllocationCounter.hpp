@@ -0,0 +1,23 @@
+#ifndef __ALLOCATION_COUNTER__
+#define __ALLOCATION_COUNTER__
+
+#include <atomic>
+
+/*
+Counts every call to the global operator new (the replacement lives in main.cpp).
+Taking the difference of two readings around a piece of code shows how many heap
+allocations it made, which is how we check that the render loop does not allocate.
+*/
+namespace AllocationCounter {
+
+	inline std::atomic<unsigned long long>& counter() {
+		static std::atomic<unsigned long long> allocations(0);
+		return allocations;
+	}
+
+	inline void increment() { counter().fetch_add(1, std::memory_order_relaxed); }
+
+	inline unsigned long long get() { return counter().load(std::memory_order_relaxed); }
+}
+
+#endif // ALLOCATION_COUNTER
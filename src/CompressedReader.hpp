@@ -0,0 +1,255 @@
+#ifndef __COMPRESSED_READER__
+#define __COMPRESSED_READER__
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "GzipDecoder.hpp"
+#include "MappedFile.hpp"
+
+/*
+Fixed number of buffers passed from one producer thread to one consumer thread.
+The producer fills a free buffer and publishes it, the consumer takes the buffers in the same
+order and releases each one when it is done with it, so at most count buffers are ever in memory.
+*/
+class BufferRing {
+private:
+	std::vector<std::vector<char>> buffers;	// allocated when first used, small files only need one
+	std::vector<size_t> sizes;
+	size_t bufferSize;
+	size_t first = 0;		// oldest published buffer
+	size_t published = 0;	// buffers between the producer and the consumer
+	bool closed = false;
+	bool cancelled = false;
+	std::mutex lock;
+	std::condition_variable changed;
+
+public:
+	BufferRing(int count, size_t capacity) : buffers(count), sizes(count, 0), bufferSize(capacity) {}
+
+	size_t capacity() const { return bufferSize; }
+
+	/*
+	Producer: wait for a free buffer, returns nullptr when the consumer cancelled
+	*/
+	char* acquire() {
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return cancelled || published < buffers.size(); });
+		if (cancelled) return nullptr;
+		std::vector<char>& buffer = buffers[(first + published) % buffers.size()];
+		if (buffer.empty()) buffer.resize(bufferSize);
+		return buffer.data();
+	}
+
+	// Producer: hand the buffer from acquire (with size bytes in it) to the consumer
+	void publish(size_t size) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			sizes[(first + published) % buffers.size()] = size;
+			published++;
+		}
+		changed.notify_all();
+	}
+
+	// Producer: there will be no more buffers
+	void close() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			closed = true;
+		}
+		changed.notify_all();
+	}
+
+	/*
+	Consumer: wait for the next buffer, returns false when the producer closed the ring and all were read
+	*/
+	bool next(const char*& data, size_t& size) {
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return published > 0 || closed; });
+		if (published == 0) return false;
+		data = buffers[first].data();
+		size = sizes[first];
+		return true;
+	}
+
+	// Consumer: give the buffer from next back to the producer
+	void release() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			first = (first + 1) % buffers.size();
+			published--;
+		}
+		changed.notify_all();
+	}
+
+	// Consumer: stop the producer, acquire returns nullptr from now on
+	void cancel() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			cancelled = true;
+		}
+		changed.notify_all();
+	}
+};
+
+/*
+Reads a gzip compressed file as a stream of decompressed buffers. One thread decompresses into a
+ring of buffers while the caller parses the buffers it already got, so loading takes as long as the
+slower of the two instead of their sum, and the decompressed file never exists as a whole (on disk or in memory).
+*/
+class CompressedReader {
+public:
+	static const int defaultBuffers = 8;
+	static const size_t defaultBufferSize = 1024 * 1024;
+
+private:
+	MappedFile file;
+	BufferRing ring;
+	std::thread decompressor;
+	bool ok = false;
+	std::string message;
+	float decompressSeconds = 0;
+	uint64_t decompressedSize = 0;
+
+	static bool endsWith(const std::string& s, const std::string& suffix) {
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	// Runs on the decompressor thread
+	void decompress() {
+		auto start = std::chrono::steady_clock::now();
+		GzipDecoder decoder(file.data(), file.size());
+		char* buffer = nullptr;
+		size_t used = 0;
+		bool decoded = decoder.decode([&](const char* p, size_t n) {
+			while (n > 0) {
+				if (buffer == nullptr) {
+					buffer = ring.acquire();
+					if (buffer == nullptr) return false;
+					used = 0;
+				}
+				size_t k = std::min(n, ring.capacity() - used);
+				std::memcpy(buffer + used, p, k);
+				used += k;
+				p += k;
+				n -= k;
+				if (used == ring.capacity()) {
+					ring.publish(used);
+					buffer = nullptr;
+				}
+			}
+			return true;
+		});
+		if (buffer != nullptr) ring.publish(used);
+		ok = decoded;
+		if (!decoded) message = decoder.error();
+		decompressedSize = decoder.size();
+		decompressSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		ring.close();
+	}
+
+public:
+	CompressedReader(int buffers = defaultBuffers, size_t bufferSize = defaultBufferSize) : ring(buffers, bufferSize) {}
+
+	CompressedReader(const CompressedReader&) = delete;
+	CompressedReader& operator=(const CompressedReader&) = delete;
+
+	~CompressedReader() {
+		ring.cancel();
+		if (decompressor.joinable()) decompressor.join();
+	}
+
+	// Compressed files are recognized by their extension
+	static bool isCompressed(const std::string& filename) { return endsWith(filename, ".gz") || endsWith(filename, ".zst"); }
+
+	// The name without the compression extension, e.g. scene.obj for scene.obj.gz
+	static std::string uncompressedName(const std::string& filename) {
+		if (endsWith(filename, ".gz")) return filename.substr(0, filename.size() - 3);
+		if (endsWith(filename, ".zst")) return filename.substr(0, filename.size() - 4);
+		return filename;
+	}
+
+	/*
+	Start decompressing, returns false (error() says why) if the file cannot be opened or is not gzip data
+	*/
+	bool open(const std::string& filename) {
+		if (endsWith(filename, ".zst")) {
+			message = "zstd compressed files are not supported, recompress it with gzip";
+			return false;
+		}
+		if (!file.open(filename)) {
+			message = "cannot open the file";
+			return false;
+		}
+		if (!GzipDecoder::isGzip(file.data(), file.size())) {
+			message = "not gzip data";
+			return false;
+		}
+		decompressor = std::thread(&CompressedReader::decompress, this);
+		return true;
+	}
+
+	/*
+	Wait for the next decompressed buffer, returns false at the end of the file.
+	The buffer stays valid until release is called.
+	*/
+	bool next(const char*& data, size_t& size) { return ring.next(data, size); }
+
+	void release() { ring.release(); }
+
+	// Stop decompressing before the end of the file, next returns the buffers already decompressed
+	void cancel() { ring.cancel(); }
+
+	/*
+	After next returned false: whether the whole file was decompressed
+	*/
+	bool finish() {
+		if (decompressor.joinable()) decompressor.join();
+		return ok;
+	}
+
+	const std::string& error() const { return message; }
+
+	size_t compressedSize() const { return file.size(); }
+
+	// After finish
+	uint64_t size() const { return decompressedSize; }
+	float seconds() const { return decompressSeconds; }
+
+	/*
+	Time decompressing the file on its own and then parse, which loads the same file, and print both:
+	when the stages overlap the load takes about as long as the slower of them
+	*/
+	static void benchmark(const std::string& filename, const std::function<void()>& parse) {
+		CompressedReader reader;
+		if (!reader.open(filename)) {
+			std::cout << filename << ": " << reader.error() << std::endl;
+			return;
+		}
+		const char* p;
+		size_t size;
+		while (reader.next(p, size)) reader.release();
+		if (!reader.finish()) {
+			std::cout << filename << ": " << reader.error() << std::endl;
+			return;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		parse();
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+		float megabytes = reader.size() / (1024.0f * 1024.0f);
+		std::cout << filename << " (" << reader.compressedSize() / (1024.0f * 1024.0f) << " MB, " << megabytes << " MB decompressed): "
+			<< "decompressing only " << reader.seconds() << " s (" << megabytes / reader.seconds() << " MB/s), "
+			<< "streamed load " << seconds << " s (" << megabytes / seconds << " MB/s)" << std::endl;
+	}
+};
+
+#endif // COMPRESSED_READER
@@ -0,0 +1,100 @@
+#ifndef __COST_IMAGES__
+#define __COST_IMAGES__
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "ImageBuffer.hpp"
+#include "RayCounters.hpp"
+
+/*
+What every pixel of a render cost: the boxes its rays hit, the triangles they tested and the
+shadow rays they fired, taken from the RayCounters of the thread that traced the pixel.
+Shown in false color they point at the parts of the scene where leaves hold too many faces
+or boxes overlap.
+*/
+class CostImages {
+public:
+	enum Kind { Boxes, Triangles, ShadowRays, KindCount };
+
+	CostImages() {}
+
+	CostImages(int _width, int _height) : width(_width), height(_height) {
+		for (int k = 0; k < KindCount; k++) values[k].assign((size_t)width * height, 0);
+	}
+
+	bool enabled() const { return width > 0; }
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	/*
+	Store what was traced for pixel (x, y) between the two readings of the counters
+	*/
+	void record(int x, int y, const RayCounters::Counts& before, const RayCounters::Counts& after) {
+		size_t i = (size_t)y * width + x;
+		values[Boxes][i] = (uint32_t)(after[RayCounters::BoxHits] - before[RayCounters::BoxHits]);
+		values[Triangles][i] = (uint32_t)(after[RayCounters::TriangleTests] - before[RayCounters::TriangleTests]);
+		values[ShadowRays][i] = (uint32_t)(after[RayCounters::Shadow] - before[RayCounters::Shadow]);
+	}
+
+	/*
+	Sum every 2x2 block into one pixel, halving both sides like ImageBuffer::downsample,
+	so the costs line up with the pixels of the supersampled image
+	*/
+	void downsample() {
+		int newWidth = width / 2;
+		int newHeight = height / 2;
+		for (int k = 0; k < KindCount; k++) {
+			std::vector<uint32_t>& v = values[k];
+			for (int y = 0; y < newHeight; y++) {
+				for (int x = 0; x < newWidth; x++) {
+					size_t i = (size_t)(2 * y) * width + 2 * x;
+					v[(size_t)y * newWidth + x] = v[i] + v[i + 1] + v[i + width] + v[i + width + 1];
+				}
+			}
+			v.resize((size_t)newWidth * newHeight);
+		}
+		width = newWidth;
+		height = newHeight;
+	}
+
+	uint32_t maximum(Kind kind) const {
+		return values[kind].empty() ? 0 : *std::max_element(values[kind].begin(), values[kind].end());
+	}
+
+	/*
+	Fill image (of the same size) with the costs of one kind, scaled from 0 (black) to the maximum (red)
+	*/
+	void colorize(Kind kind, ImageBuffer& image) const {
+		float scale = 1.0f / std::max(maximum(kind), (uint32_t)1);
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++)
+				image.pixel(x, y) = falseColor(values[kind][(size_t)y * width + x] * scale);
+	}
+
+	/*
+	Black -> blue -> cyan -> green -> yellow -> red for t from 0 to 1
+	*/
+	static Eigen::Vector3f falseColor(float t) {
+		static const float stops[6][3] = { { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } };
+		float position = std::min(std::max(t, 0.0f), 1.0f) * 5.0f;
+		int i = std::min((int)position, 4);
+		float f = position - i;
+		return Eigen::Vector3f(stops[i][0] + f * (stops[i + 1][0] - stops[i][0]), stops[i][1] + f * (stops[i + 1][1] - stops[i][1]),
+			stops[i][2] + f * (stops[i + 1][2] - stops[i][2]));
+	}
+
+	static const char* name(Kind kind) {
+		static const char* names[KindCount] = { "boxes", "triangles", "shadow_rays" };
+		return names[kind];
+	}
+
+private:
+	int width = 0;
+	int height = 0;
+	std::vector<uint32_t> values[KindCount];
+};
+
+#endif // COST_IMAGES
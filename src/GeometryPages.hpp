@@ -0,0 +1,261 @@
+#ifndef __GEOMETRY_PAGES__
+#define __GEOMETRY_PAGES__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "MemoryTracker.hpp"
+
+/*
+Out-of-core triangles: the faces live in a page file and only the pages that are being traced are in memory.
+Faces are stored in the order of the boxes of the acceleration structure (a face in two boxes is stored twice),
+so a page holds neighbouring faces and every box is one range of face ids. Pages are read on demand into
+a shared LRU cache. On top of that every thread keeps the last few pages it used (an evicted page stays
+in memory until those threads move on to other pages or call releaseThreadPages), the LRU cache leaves
+room for those so the pages in memory never take more than cacheBytes.
+*/
+class GeometryPages {
+public:
+	static const uint32_t version = 2;
+	static const uint32_t facesPerPage = 1024;
+
+	// Everything the tracer needs of a face
+	struct Face {
+		float vertices[9];		// 3 corners, world space
+		float normal[3];
+		uint16_t material;
+		uint16_t unused;
+	};
+
+	struct Header {
+		char magic[8];			// "RTPAGES"
+		uint32_t version;
+		uint32_t headerSize;
+		uint32_t faceCount;
+		uint32_t facesPerPage;
+	};
+
+	struct Statistics {
+		uint64_t lookups = 0;	// pages asked from the shared cache (not found in the slots of the thread)
+		uint64_t hits = 0;
+		uint64_t faults = 0;	// pages read from the file
+		uint64_t evictions = 0;
+		uint64_t bytesRead = 0;
+		size_t peakBytes = 0;
+	};
+
+	/*
+	Writes a page file one face at a time
+	*/
+	class Writer {
+	private:
+		std::ofstream out;
+		Header header;
+
+	public:
+		bool open(const std::string& filename) {
+			out.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+			std::memset(&header, 0, sizeof(Header));
+			std::memcpy(header.magic, "RTPAGES", 8);
+			header.version = version;
+			header.headerSize = sizeof(Header);
+			header.facesPerPage = facesPerPage;
+			out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			return out.good();
+		}
+
+		// Id of the face in the file
+		uint32_t add(const Face& face) {
+			out.write(reinterpret_cast<const char*>(&face), sizeof(Face));
+			return header.faceCount++;
+		}
+
+		bool close() {
+			out.seekp(0);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			out.close();
+			return !out.fail();
+		}
+	};
+
+private:
+	typedef std::vector<Face> Page;
+
+	// The last pages a thread used, so most lookups need no lock
+	static const int localSlots = 8;
+	struct Slot {
+		uint64_t owner = 0;
+		uint32_t page = 0;
+		std::shared_ptr<const Page> data;
+	};
+
+	static uint64_t nextSerial() {
+		static std::atomic<uint64_t> counter(0);
+		return ++counter;
+	}
+
+	static Slot* localSlotsOfThread() {
+		thread_local Slot slots[localSlots];
+		return slots;
+	}
+
+	uint64_t serial = nextSerial();		// tells the thread slots of different page files apart
+	uint32_t faceCount = 0;
+	size_t cacheBytes = 0;
+	size_t lruBytes = 0;	// cacheBytes without the pages the threads may hold on to
+	size_t pageBytes = facesPerPage * sizeof(Face);
+
+	std::ifstream file;
+	std::mutex fileLock;
+
+	// most recently used page first
+	std::list<std::pair<uint32_t, std::shared_ptr<const Page>>> recent;
+	std::unordered_map<uint32_t, std::list<std::pair<uint32_t, std::shared_ptr<const Page>>>::iterator> cached;
+	size_t cachedBytes = 0;
+	Statistics statistics;
+	mutable std::mutex lock;
+
+	std::shared_ptr<const Page> readPage(uint32_t page) {
+		uint32_t first = page * facesPerPage;
+		std::shared_ptr<Page> data(new Page(std::min(facesPerPage, faceCount - first)));
+		std::lock_guard<std::mutex> guard(fileLock);
+		file.seekg(sizeof(Header) + (uint64_t)first * sizeof(Face));
+		if (!file.read(reinterpret_cast<char*>(data->data()), data->size() * sizeof(Face))) {
+			// the next page can still be read, this one is lost
+			file.clear();
+			throw std::runtime_error("cannot read page " + std::to_string(page) + " of the page file");
+		}
+		return data;
+	}
+
+	// The page from the shared cache, read from the file (evicting the least recently used pages) when missing
+	std::shared_ptr<const Page> fetch(uint32_t page) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			statistics.lookups++;
+			auto found = cached.find(page);
+			if (found != cached.end()) {
+				statistics.hits++;
+				recent.splice(recent.begin(), recent, found->second);
+				return found->second->second;
+			}
+		}
+
+		// read without holding the cache, another thread may read the same page meanwhile
+		MemoryTracker::Scope scope(MemoryTracker::Geometry);
+		std::shared_ptr<const Page> data = readPage(page);
+
+		std::lock_guard<std::mutex> guard(lock);
+		statistics.faults++;
+		statistics.bytesRead += data->size() * sizeof(Face);
+		auto found = cached.find(page);
+		if (found != cached.end()) return found->second->second;
+		while (!recent.empty() && cachedBytes + pageBytes > lruBytes) {
+			cached.erase(recent.back().first);
+			recent.pop_back();
+			cachedBytes -= pageBytes;
+			statistics.evictions++;
+		}
+		recent.push_front(std::make_pair(page, data));
+		cached[page] = recent.begin();
+		cachedBytes += pageBytes;
+		statistics.peakBytes = std::max(statistics.peakBytes, cachedBytes);
+		return data;
+	}
+
+public:
+	GeometryPages() {}
+
+	GeometryPages(const GeometryPages&) = delete;
+	GeometryPages& operator=(const GeometryPages&) = delete;
+
+	/*
+	Open a page file, returns false (after printing why) if it is not one.
+	The pages in memory take at most cacheBytes when no more than threads threads read faces, but the
+	LRU cache always holds at least one page.
+	*/
+	bool open(const std::string& filename, size_t cacheBytes, int threads) {
+		file.open(filename.c_str(), std::ios::binary);
+		Header header;
+		if (!file.read(reinterpret_cast<char*>(&header), sizeof(Header)) || std::memcmp(header.magic, "RTPAGES", 8) != 0
+			|| header.version != version || header.headerSize != sizeof(Header) || header.facesPerPage != facesPerPage) {
+			std::cerr << filename << " is not a page file of version " << version << std::endl;
+			file.close();
+			return false;
+		}
+		faceCount = header.faceCount;
+		size_t threadBytes = (size_t)std::max(threads, 1) * localSlots * pageBytes;
+		lruBytes = cacheBytes > threadBytes + pageBytes ? cacheBytes - threadBytes : pageBytes;
+		this->cacheBytes = lruBytes + threadBytes;
+		if (this->cacheBytes > cacheBytes)
+			std::cout << "Page cache: " << cacheBytes / (1024.0f * 1024.0f) << " MB is too small for " << threads << " threads, using "
+				<< this->cacheBytes / (1024.0f * 1024.0f) << " MB" << std::endl;
+		serial = nextSerial();
+		return true;
+	}
+
+	bool isOpen() const { return file.is_open(); }
+
+	uint32_t size() const { return faceCount; }
+
+	uint32_t pages() const { return (faceCount + facesPerPage - 1) / facesPerPage; }
+
+	size_t capacity() const { return cacheBytes; }
+
+	/*
+	A face by its id in the file. The reference stays valid until the calling thread looks up a face
+	of another page in the same slot (page % localSlots), which can be the very next lookup.
+	Throws std::runtime_error if the page cannot be read.
+	*/
+	const Face& face(uint32_t id) {
+		uint32_t page = id / facesPerPage;
+		Slot& slot = localSlotsOfThread()[page % localSlots];
+		if (slot.owner != serial || slot.page != page || !slot.data) {
+			slot.data = fetch(page);
+			slot.owner = serial;
+			slot.page = page;
+		}
+		return (*slot.data)[id % facesPerPage];
+	}
+
+	/*
+	Drop the pages the calling thread holds on to, done by every thread at the end of a render
+	*/
+	static void releaseThreadPages() {
+		Slot* slots = localSlotsOfThread();
+		for (int i = 0; i < localSlots; i++) slots[i] = Slot();
+	}
+
+	Statistics getStatistics() const {
+		std::lock_guard<std::mutex> guard(lock);
+		return statistics;
+	}
+
+	void resetStatistics() {
+		std::lock_guard<std::mutex> guard(lock);
+		statistics = Statistics();
+		statistics.peakBytes = cachedBytes;
+	}
+
+	void printStatistics() const {
+		Statistics s = getStatistics();
+		float rate = s.lookups > 0 ? (100.0f * s.hits) / s.lookups : 0.0f;
+		std::cout << "Page cache: " << s.hits << " hits / " << s.lookups << " lookups (" << rate << "% hit rate), "
+			<< s.faults << " page faults (" << s.bytesRead / (1024.0f * 1024.0f) << " MB read), " << s.evictions << " evictions, "
+			<< "peak " << s.peakBytes / (1024.0f * 1024.0f) << " of " << lruBytes / (1024.0f * 1024.0f) << " MB ("
+			<< cacheBytes / (1024.0f * 1024.0f) << " MB with the pages the threads hold on to)" << std::endl;
+	}
+};
+
+#endif // GEOMETRY_PAGES
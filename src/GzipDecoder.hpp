@@ -0,0 +1,377 @@
+#ifndef __GZIP_DECODER__
+#define __GZIP_DECODER__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+Decompresses gzip data (RFC 1952 around RFC 1951 deflate blocks), there is no zlib in the dependencies.
+The output is handed to a sink in pieces of up to flushSize bytes while decoding, so a whole file never
+has to be held in memory. Files made of several gzip members are decoded one member after the other,
+the CRC and size of every member are checked.
+*/
+class GzipDecoder {
+public:
+	// Receives the decoded bytes, returns false to stop decoding
+	typedef std::function<bool(const char*, size_t)> Sink;
+
+	static const size_t windowSize = 32 * 1024;
+	static const size_t flushSize = 256 * 1024;
+
+private:
+	// Codes up to this length are decoded with one table lookup, longer ones bit by bit
+	static const int fastBits = 10;
+	static const int maxBits = 15;
+	static const size_t maxMatch = 258;
+
+	/*
+	Canonical Huffman code. fast holds (length << 9) | symbol for every fastBits bit pattern
+	starting with a short code, 0 when the code of the pattern is longer.
+	*/
+	struct Huffman {
+		uint16_t fast[1 << fastBits];
+		uint16_t count[maxBits + 1];
+		uint16_t symbols[288];
+
+		// Returns false for lengths that do not form a prefix code
+		bool build(const uint8_t* lengths, int n) {
+			std::memset(count, 0, sizeof(count));
+			std::memset(fast, 0, sizeof(fast));
+			for (int i = 0; i < n; i++) count[lengths[i]]++;
+			count[0] = 0;
+			int left = 1;
+			for (int len = 1; len <= maxBits; len++) {
+				left = (left << 1) - count[len];
+				if (left < 0) return false;
+			}
+
+			uint16_t offsets[maxBits + 2];
+			offsets[1] = 0;
+			for (int len = 1; len <= maxBits; len++) offsets[len + 1] = offsets[len] + count[len];
+			uint16_t next[maxBits + 2];
+			std::memcpy(next, offsets, sizeof(next));
+			for (int i = 0; i < n; i++)
+				if (lengths[i] != 0) symbols[next[lengths[i]]++] = (uint16_t)i;
+
+			// canonical codes, stored bit reversed because deflate sends them starting with the high bit
+			int code = 0;
+			for (int len = 1; len <= fastBits; len++) {
+				for (int k = 0; k < count[len]; k++, code++) {
+					int reversed = 0;
+					for (int b = 0; b < len; b++) reversed |= ((code >> b) & 1) << (len - 1 - b);
+					uint16_t entry = (uint16_t)((len << 9) | symbols[offsets[len] + k]);
+					for (int fill = reversed; fill < (1 << fastBits); fill += 1 << len) fast[fill] = entry;
+				}
+				code <<= 1;
+			}
+			return true;
+		}
+	};
+
+	const unsigned char* in;
+	const unsigned char* inEnd;
+	uint64_t bitBuffer = 0;
+	int bitCount = 0;
+	int padding = 0;		// zero bits added to the bit buffer after the end of the input
+
+	// decoded bytes, the first windowSize bytes are history for back references once a piece was flushed
+	std::vector<char> out;
+	size_t outPos = 0;
+	size_t flushed = 0;		// out before this was handed to the sink
+	uint64_t memberSize = 0;
+	uint32_t crc = 0;
+	uint64_t decodedSize = 0;
+	std::string message;
+
+	static const uint32_t* crcTable() {
+		static const std::vector<uint32_t> table = [] {
+			std::vector<uint32_t> t(256);
+			for (uint32_t i = 0; i < 256; i++) {
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				t[i] = c;
+			}
+			return t;
+		}();
+		return table.data();
+	}
+
+	static uint32_t updateCrc(uint32_t crc, const char* p, size_t n) {
+		const uint32_t* table = crcTable();
+		crc = ~crc;
+		for (size_t i = 0; i < n; i++) crc = table[(crc ^ (unsigned char)p[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	bool fail(const std::string& why) {
+		if (message.empty()) message = why;
+		return false;
+	}
+
+	void refill() {
+		while (bitCount <= 56) {
+			if (in < inEnd) bitBuffer |= (uint64_t)*in++ << bitCount;
+			else if (bitCount >= maxBits) return;
+			else padding += 8;
+			bitCount += 8;
+		}
+	}
+
+	// Bits past the end of the input were used
+	bool truncated() const { return bitCount < padding; }
+
+	uint32_t bits(int n) {
+		if (bitCount < n) refill();
+		uint32_t value = (uint32_t)(bitBuffer & ((1ull << n) - 1));
+		bitBuffer >>= n;
+		bitCount -= n;
+		return value;
+	}
+
+	// Give whole bytes left in the bit buffer back to the input, for the parts that are byte aligned
+	void alignToByte() {
+		bitCount -= bitCount % 8;
+		if (bitCount > padding) in -= (bitCount - padding) / 8;
+		bitBuffer = 0;
+		bitCount = 0;
+		padding = 0;
+	}
+
+	int decodeSymbol(const Huffman& h) {
+		if (bitCount < maxBits) refill();
+		uint16_t entry = h.fast[bitBuffer & ((1 << fastBits) - 1)];
+		if (entry != 0) {
+			int len = entry >> 9;
+			bitBuffer >>= len;
+			bitCount -= len;
+			return entry & 511;
+		}
+		// longer code: walk the canonical code one bit at a time
+		int code = 0, first = 0, index = 0;
+		for (int len = 1; len <= maxBits; len++) {
+			code |= (int)((bitBuffer >> (len - 1)) & 1);
+			int count = h.count[len];
+			if (code - first < count) {
+				bitBuffer >>= len;
+				bitCount -= len;
+				return h.symbols[index + (code - first)];
+			}
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+		return -1;
+	}
+
+	// Hand the new bytes to the sink and keep the last windowSize bytes for back references
+	bool flush(const Sink& sink) {
+		if (outPos > flushed) {
+			crc = updateCrc(crc, out.data() + flushed, outPos - flushed);
+			decodedSize += outPos - flushed;
+			if (!sink(out.data() + flushed, outPos - flushed)) return fail("stopped");
+		}
+		if (outPos > windowSize) {
+			std::memmove(out.data(), out.data() + outPos - windowSize, windowSize);
+			outPos = windowSize;
+		}
+		flushed = outPos;
+		return true;
+	}
+
+	bool storedBlock(const Sink& sink) {
+		alignToByte();
+		if (inEnd - in < 4) return fail("truncated stored block");
+		uint16_t length = (uint16_t)(in[0] | (in[1] << 8));
+		uint16_t complement = (uint16_t)(in[2] | (in[3] << 8));
+		in += 4;
+		if ((uint16_t)~length != complement) return fail("corrupt stored block length");
+		if ((size_t)(inEnd - in) < length) return fail("truncated stored block");
+		while (length > 0) {
+			if (outPos >= windowSize + flushSize && !flush(sink)) return false;
+			size_t n = std::min<size_t>(length, windowSize + flushSize - outPos);
+			std::memcpy(out.data() + outPos, in, n);
+			in += n;
+			outPos += n;
+			memberSize += n;
+			length -= (uint16_t)n;
+		}
+		return true;
+	}
+
+	bool dynamicTables(Huffman& literals, Huffman& distances) {
+		static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+		int literalCount = bits(5) + 257;
+		int distanceCount = bits(5) + 1;
+		int codeCount = bits(4) + 4;
+		if (literalCount > 286 || distanceCount > 30) return fail("bad table size");
+
+		uint8_t lengths[320] = {};
+		for (int i = 0; i < codeCount; i++) lengths[order[i]] = (uint8_t)bits(3);
+		Huffman lengthCode;
+		if (!lengthCode.build(lengths, 19)) return fail("bad code length code");
+
+		std::memset(lengths, 0, sizeof(lengths));
+		int i = 0;
+		while (i < literalCount + distanceCount) {
+			int symbol = decodeSymbol(lengthCode);
+			if (symbol < 0) return fail("bad code length");
+			if (symbol < 16) {
+				lengths[i++] = (uint8_t)symbol;
+				continue;
+			}
+			uint8_t repeated = 0;
+			int repeat;
+			if (symbol == 16) {
+				if (i == 0) return fail("repeat without a previous length");
+				repeated = lengths[i - 1];
+				repeat = 3 + bits(2);
+			}
+			else if (symbol == 17) repeat = 3 + bits(3);
+			else repeat = 11 + bits(7);
+			if (i + repeat > literalCount + distanceCount) return fail("too many code lengths");
+			while (repeat-- > 0) lengths[i++] = repeated;
+		}
+		if (lengths[256] == 0) return fail("no end of block code");
+		if (!literals.build(lengths, literalCount)) return fail("bad literal code");
+		if (!distances.build(lengths + literalCount, distanceCount)) return fail("bad distance code");
+		return true;
+	}
+
+	bool codes(const Huffman& literals, const Huffman& distances, const Sink& sink) {
+		static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+			35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+			3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+			257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+			7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		char* o = out.data();
+		for (;;) {
+			if (truncated()) return fail("truncated data");
+			if (outPos >= windowSize + flushSize && !flush(sink)) return false;
+			int symbol = decodeSymbol(literals);
+			if (symbol < 256) {
+				if (symbol < 0) return fail("bad literal");
+				o[outPos++] = (char)symbol;
+				memberSize++;
+				continue;
+			}
+			if (symbol == 256) return true;
+
+			symbol -= 257;
+			if (symbol >= 29) return fail("bad length");
+			size_t length = lengthBase[symbol] + bits(lengthExtra[symbol]);
+			int distanceSymbol = decodeSymbol(distances);
+			if (distanceSymbol < 0 || distanceSymbol >= 30) return fail("bad distance");
+			size_t distance = distanceBase[distanceSymbol] + bits(distanceExtra[distanceSymbol]);
+			if (distance > outPos || distance > memberSize) return fail("distance too far back");
+
+			const char* from = o + outPos - distance;
+			char* to = o + outPos;
+			if (distance >= length) std::memcpy(to, from, length);
+			else for (size_t k = 0; k < length; k++) to[k] = from[k];
+			outPos += length;
+			memberSize += length;
+		}
+	}
+
+	// Skip the gzip header of a member, returns false if there is none
+	bool header() {
+		if (inEnd - in < 10) return fail("truncated header");
+		if (in[0] != 0x1f || in[1] != 0x8b) return fail("not gzip data");
+		if (in[2] != 8) return fail("unknown compression method");
+		unsigned char flags = in[3];
+		in += 10;
+		if (flags & 4) {
+			if (inEnd - in < 2) return fail("truncated header");
+			size_t extra = in[0] | (in[1] << 8);
+			in += 2;
+			if ((size_t)(inEnd - in) < extra) return fail("truncated header");
+			in += extra;
+		}
+		for (int field = 8; field <= 16; field <<= 1) {
+			if (!(flags & field)) continue;
+			// file name or comment, zero terminated
+			const unsigned char* zero = (const unsigned char*)std::memchr(in, 0, inEnd - in);
+			if (zero == nullptr) return fail("truncated header");
+			in = zero + 1;
+		}
+		if (flags & 2) {
+			if (inEnd - in < 2) return fail("truncated header");
+			in += 2;
+		}
+		return true;
+	}
+
+	bool member(const Sink& sink) {
+		static Huffman fixedLiterals, fixedDistances;
+		static bool fixedBuilt = [] {
+			uint8_t lengths[288];
+			for (int i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+			fixedLiterals.build(lengths, 288);
+			for (int i = 0; i < 30; i++) lengths[i] = 5;
+			fixedDistances.build(lengths, 30);
+			return true;
+		}();
+		(void)fixedBuilt;
+
+		if (!header()) return false;
+		crc = 0;
+		memberSize = 0;
+		Huffman literals, distances;
+		bool last = false;
+		while (!last) {
+			last = bits(1) == 1;
+			uint32_t type = bits(2);
+			bool ok;
+			if (type == 0) ok = storedBlock(sink);
+			else if (type == 1) ok = codes(fixedLiterals, fixedDistances, sink);
+			else if (type == 2) ok = dynamicTables(literals, distances) && codes(literals, distances, sink);
+			else ok = fail("bad block type");
+			if (!ok) return false;
+			if (truncated()) return fail("truncated data");
+		}
+		if (!flush(sink)) return false;
+
+		alignToByte();
+		if (inEnd - in < 8) return fail("truncated trailer");
+		uint32_t storedCrc = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+		uint32_t storedSize = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+		in += 8;
+		if (storedCrc != crc) return fail("CRC mismatch");
+		if (storedSize != (uint32_t)memberSize) return fail("size mismatch");
+		return true;
+	}
+
+public:
+	GzipDecoder(const char* data, size_t size)
+		: in((const unsigned char*)data), inEnd((const unsigned char*)data + size), out(windowSize + flushSize + maxMatch) {}
+
+	// gzip data starts with these two bytes
+	static bool isGzip(const char* data, size_t size) {
+		return size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b;
+	}
+
+	/*
+	Decode all members, returns false if the data is not valid gzip (error() says why) or the sink stopped
+	*/
+	bool decode(const Sink& sink) {
+		do {
+			if (!member(sink)) return false;
+		} while (inEnd - in >= 2 && isGzip((const char*)in, inEnd - in));
+		return true;
+	}
+
+	const std::string& error() const { return message; }
+
+	// Bytes handed to the sink so far
+	uint64_t size() const { return decodedSize; }
+};
+
+#endif // GZIP_DECODER
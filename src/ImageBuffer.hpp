@@ -0,0 +1,109 @@
+#ifndef __IMAGE_BUFFER__
+#define __IMAGE_BUFFER__
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+/*
+The colors of a rendered image in a single allocation aligned to a cache line.
+Pixels are stored tile after tile (tiles in rows, the pixels of a tile row by row), so a tile of the
+TileScheduler is one contiguous block: a worker writes only its own memory (first touching it, which
+places it on the worker's NUMA node) and tiles of different workers do not share cache lines.
+Writers read the image row by row through Row views, nothing is copied.
+The memory is left uninitialized, every pixel has to be written before it is read.
+*/
+class ImageBuffer {
+public:
+	static const size_t alignment = 64;
+
+	// One row of the image, pixel x of it is where the tiled layout keeps it
+	class Row {
+	private:
+		const ImageBuffer* image;
+		int y;
+
+	public:
+		Row(const ImageBuffer* _image, int _y) : image(_image), y(_y) {}
+
+		const Eigen::Vector3f& operator[](int x) const { return image->pixel(x, y); }
+
+		int size() const { return image->getWidth(); }
+	};
+
+private:
+	std::unique_ptr<char[]> memory;
+	Eigen::Vector3f* pixels = nullptr;
+	int width = 0;
+	int height = 0;
+	int tileSize = 2;
+
+	// Position of pixel (x, y) in an image of that size and tile size
+	static size_t index(int x, int y, int width, int height, int tileSize) {
+		int tx = x / tileSize;
+		int ty = y / tileSize;
+		int tileWidth = std::min(tileSize, width - tx * tileSize);
+		int tileHeight = std::min(tileSize, height - ty * tileSize);
+		return (size_t)ty * tileSize * width + (size_t)tx * tileSize * tileHeight + (size_t)(y - ty * tileSize) * tileWidth + (x - tx * tileSize);
+	}
+
+public:
+	ImageBuffer() {}
+
+	/*
+	The tile size is rounded up to an even number, so the image can be downsampled in place
+	*/
+	ImageBuffer(int _width, int _height, int _tileSize) : width(std::max(_width, 0)), height(std::max(_height, 0)) {
+		tileSize = std::max(_tileSize + _tileSize % 2, 2);
+		size_t bytes = (size_t)width * height * sizeof(Eigen::Vector3f);
+		memory.reset(new char[bytes + alignment]);
+		uintptr_t address = reinterpret_cast<uintptr_t>(memory.get());
+		pixels = reinterpret_cast<Eigen::Vector3f*>((address + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	}
+
+	ImageBuffer(ImageBuffer&&) = default;
+	ImageBuffer& operator=(ImageBuffer&&) = default;
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getTileSize() const { return tileSize; }
+
+	Eigen::Vector3f& pixel(int x, int y) { return pixels[index(x, y, width, height, tileSize)]; }
+	const Eigen::Vector3f& pixel(int x, int y) const { return pixels[index(x, y, width, height, tileSize)]; }
+
+	Row row(int y) const { return Row(this, y); }
+
+	size_t bytes() const { return (size_t)width * height * sizeof(Eigen::Vector3f); }
+
+	/*
+	Average every 2x2 block into one pixel, halving both sides (an odd last column or row is dropped).
+	Works in place: the smaller image keeps the same tiles at half the size, so every pixel is written
+	at or before the first position of its block and nothing is overwritten before it is read.
+	That only holds when the pixels are visited in order, so it runs on the calling thread.
+	The tile size is halved as well, the image can be downsampled again while it stays even.
+	*/
+	void downsample() {
+		int newWidth = width / 2;
+		int newHeight = height / 2;
+		int newTileSize = tileSize / 2;
+		for (int ty = 0; ty * newTileSize < newHeight; ty++) {
+			for (int tx = 0; tx * newTileSize < newWidth; tx++) {
+				for (int y = ty * newTileSize; y < std::min((ty + 1) * newTileSize, newHeight); y++) {
+					for (int x = tx * newTileSize; x < std::min((tx + 1) * newTileSize, newWidth); x++)
+						pixels[index(x, y, newWidth, newHeight, newTileSize)] = averageBlock(x, y);
+				}
+			}
+		}
+		width = newWidth;
+		height = newHeight;
+		tileSize = newTileSize;
+	}
+
+private:
+	Eigen::Vector3f averageBlock(int x, int y) const {
+		return (pixel(2 * x, 2 * y) + pixel(2 * x, 2 * y + 1) + pixel(2 * x + 1, 2 * y) + pixel(2 * x + 1, 2 * y + 1)) / 4;
+	}
+};
+
+#endif // IMAGE_BUFFER
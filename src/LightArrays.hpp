@@ -0,0 +1,35 @@
+#ifndef __LIGHT_ARRAYS__
+#define __LIGHT_ARRAYS__
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <vector>
+
+/*
+The lights as the tracer sees them: one array per property and no OpenGL objects, so render threads
+read them without copying anything (the viewer draws its own SphereLight shapes). The sampling points
+of light i, used for soft shadows, are samplePoints firstSample[i] -> firstSample[i + 1].
+*/
+struct LightArrays {
+	std::vector<Eigen::Vector3f> positions;
+	std::vector<Eigen::Vector3f> colors;
+	std::vector<uint32_t> firstSample = std::vector<uint32_t>(1, 0);
+	std::vector<Eigen::Vector3f> samplePoints;	// world space
+
+	void add(const Eigen::Vector3f& position, const Eigen::Vector3f& color, const std::vector<Eigen::Vector3f>& samplingPoints) {
+		positions.push_back(position);
+		colors.push_back(color);
+		samplePoints.insert(samplePoints.end(), samplingPoints.begin(), samplingPoints.end());
+		firstSample.push_back(samplePoints.size());
+	}
+
+	void clear() { *this = LightArrays(); }
+
+	int size() const { return positions.size(); }
+
+	int sampleCount(int light) const { return firstSample[light + 1] - firstSample[light]; }
+
+	const Eigen::Vector3f* samples(int light) const { return samplePoints.data() + firstSample[light]; }
+};
+
+#endif // LIGHT_ARRAYS
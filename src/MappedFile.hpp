@@ -0,0 +1,95 @@
+#ifndef __MAPPED_FILE__
+#define __MAPPED_FILE__
+
+#if _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <cstddef>
+#include <string>
+
+/*
+A file mapped read-only into memory, the operating system pages it in when it is read.
+Mapping an empty file is not possible, it opens fine but data() is nullptr.
+*/
+class MappedFile {
+private:
+	const char* bytes = nullptr;
+	size_t length = 0;
+#if _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+
+public:
+	MappedFile() {}
+
+	MappedFile(const std::string& filename) { open(filename); }
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() { close(); }
+
+	/*
+	Map the file, returns false if it cannot be opened
+	*/
+	bool open(const std::string& filename) {
+		close();
+#if _WIN32
+		file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		length = (size_t)size.QuadPart;
+		if (length == 0) return true;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) { close(); return false; }
+		bytes = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (bytes == nullptr) { close(); return false; }
+#else
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat info;
+		if (fstat(fd, &info) != 0) { ::close(fd); return false; }
+		length = (size_t)info.st_size;
+		if (length > 0) {
+			void* p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) { ::close(fd); length = 0; return false; }
+			bytes = (const char*)p;
+			// the file is read front to back (in a few parallel ranges)
+			madvise(p, length, MADV_WILLNEED);
+		}
+		// the mapping stays valid after closing the descriptor
+		::close(fd);
+#endif
+		return true;
+	}
+
+	void close() {
+#if _WIN32
+		if (bytes != nullptr) UnmapViewOfFile(bytes);
+		if (mapping != NULL) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (bytes != nullptr) munmap((void*)bytes, length);
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	const char* data() const { return bytes; }
+	size_t size() const { return length; }
+};
+
+#endif // MAPPED_FILE
@@ -0,0 +1,66 @@
+#ifndef __MATERIAL_TABLE__
+#define __MATERIAL_TABLE__
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <vector>
+#include <tucano/materials/mtl.hpp>
+#include "SceneGeometry.hpp"
+
+/*
+The materials compiled for shading, one array per property indexed by the MaterialId of a face.
+Built once the materials are loaded, the tracer reads the few values it needs instead of going
+through Tucano::Material::Mtl and its getters for every hit and light.
+*/
+class MaterialTable {
+public:
+	// Largest number of materials a MaterialId can tell apart
+	static const size_t maxMaterials = 65536;
+
+	// Classes of materials, a scene without a class skips all work for it
+	enum Flags : uint8_t {
+		Reflective = 1,		// illumination model 3: reflection on and ray trace on (http://paulbourke.net/dataformats/mtl/)
+		Specular = 2,		// a specular color other than black, the others skip the highlight
+	};
+
+	std::vector<Eigen::Vector3f> ambient;
+	std::vector<Eigen::Vector3f> diffuse;
+	std::vector<Eigen::Vector3f> specular;
+	std::vector<float> shininess;
+	std::vector<Eigen::Vector3f> reflectivity;	// attenuation of a reflected ray, zero for materials that do not reflect
+	std::vector<uint8_t> flags;
+
+	MaterialTable() {}
+
+	/*
+	Compile the materials, returns false (and leaves the table empty) when there are more than a MaterialId holds
+	*/
+	bool compile(const std::vector<Tucano::Material::Mtl>& materials) {
+		*this = MaterialTable();
+		if (materials.size() > maxMaterials) return false;
+		for (const Tucano::Material::Mtl& m : materials) {
+			uint8_t materialFlags = m.getIlluminationModel() == 3 ? Reflective : 0;
+			if (!m.getSpecular().isZero(0.0f)) materialFlags |= Specular;
+			ambient.push_back(m.getAmbient());
+			diffuse.push_back(m.getDiffuse());
+			specular.push_back(m.getSpecular());
+			shininess.push_back(m.getShininess());
+			reflectivity.push_back((materialFlags & Reflective) ? m.getSpecular() : Eigen::Vector3f::Zero());
+			flags.push_back(materialFlags);
+			classes |= materialFlags;
+		}
+		return true;
+	}
+
+	size_t size() const { return flags.size(); }
+
+	bool is(MaterialId id, Flags flag) const { return (flags[id] & flag) != 0; }
+
+	// Whether any material of the scene is of the class
+	bool any(Flags flag) const { return (classes & flag) != 0; }
+
+private:
+	uint8_t classes = 0;
+};
+
+#endif // MATERIAL_TABLE
@@ -0,0 +1,117 @@
+#ifndef __MEMORY_TRACKER__
+#define __MEMORY_TRACKER__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <initializer_list>
+#include <iostream>
+#include <new>
+
+/*
+Heap memory per subsystem. The global operator new (replaced in main.cpp) puts a small header
+in front of every block with its size and the tag of the subsystem that asked for it, so the
+matching delete takes the bytes off the same tag wherever the block is freed.
+The tag of an allocation is the one of the innermost Scope on the allocating thread, tasks
+submitted to a ThreadPool run under the tag of the thread that submitted them.
+Only the heap is counted: memory mapped files (.rtscene scenes, the OBJ and PLY files being parsed) are not.
+*/
+namespace MemoryTracker {
+
+	enum Tag : uint8_t {
+		Other,			// not in any scope
+		Geometry,		// loaded files, the flat scene arrays, page cache and NUMA copies
+		Acceleration,	// boxes and their face lists
+		Lights,			// lights and their sampling points
+		Framebuffer,	// rendered images
+		Viewer,			// preview mesh, debug rays and the other OpenGL shapes
+		TagCount
+	};
+
+	inline const char* tagName(Tag tag) {
+		static const char* names[TagCount] = { "other", "geometry", "acceleration", "lights", "framebuffer", "viewer" };
+		return names[tag];
+	}
+
+	struct Counters {
+		std::atomic<long long> bytes;
+		std::atomic<long long> peakBytes;
+		std::atomic<long long> blocks;		// allocated and not freed yet
+		std::atomic<long long> allocations;	// since the start
+	};
+
+	inline Counters& counters(Tag tag) {
+		static Counters all[TagCount];
+		return all[tag];
+	}
+
+	// All tags together, the peak of the sum is not the sum of the peaks of the tags
+	inline Counters& total() {
+		static Counters all;
+		return all;
+	}
+
+	inline Tag& currentTag() {
+		thread_local Tag tag = Other;
+		return tag;
+	}
+
+	// Keeps the blocks behind it aligned like the ones malloc returns
+	static const size_t headerSize = 16;
+
+	inline void* allocate(size_t size) {
+		char* block = static_cast<char*>(std::malloc(size + headerSize));
+		if (block == nullptr) throw std::bad_alloc();
+		Tag tag = currentTag();
+		*reinterpret_cast<size_t*>(block) = size;
+		block[sizeof(size_t)] = tag;
+
+		for (Counters* c : { &counters(tag), &total() }) {
+			long long bytes = c->bytes.fetch_add(size, std::memory_order_relaxed) + size;
+			long long peak = c->peakBytes.load(std::memory_order_relaxed);
+			while (bytes > peak && !c->peakBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {}
+			c->blocks.fetch_add(1, std::memory_order_relaxed);
+			c->allocations.fetch_add(1, std::memory_order_relaxed);
+		}
+		return block + headerSize;
+	}
+
+	inline void release(void* p) {
+		if (p == nullptr) return;
+		char* block = static_cast<char*>(p) - headerSize;
+		size_t size = *reinterpret_cast<size_t*>(block);
+		for (Counters* c : { &counters((Tag)block[sizeof(size_t)]), &total() }) {
+			c->bytes.fetch_sub(size, std::memory_order_relaxed);
+			c->blocks.fetch_sub(1, std::memory_order_relaxed);
+		}
+		std::free(block);
+	}
+
+	/*
+	Attributes the allocations of this thread to a tag while it lives
+	*/
+	class Scope {
+		Tag previous;
+	public:
+		explicit Scope(Tag tag) : previous(currentTag()) { currentTag() = tag; }
+		~Scope() { currentTag() = previous; }
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	/*
+	Print the current and peak bytes and the allocations of every tag and of all of them
+	*/
+	inline void print(const char* when) {
+		const float megabytes = 1024.0f * 1024.0f;
+		auto line = [&](const char* name, const Counters& c) {
+			std::cout << "  " << name << ": " << c.bytes.load() / megabytes << " MB (peak " << c.peakBytes.load() / megabytes
+				<< " MB), " << c.blocks.load() << " blocks, " << c.allocations.load() << " allocations" << std::endl;
+		};
+		std::cout << "Memory " << when << " (heap only, mapped files are not counted):" << std::endl;
+		for (int t = 0; t < TagCount; t++) line(tagName((Tag)t), counters((Tag)t));
+		line("total", total());
+	}
+}
+
+#endif // MEMORY_TRACKER
@@ -0,0 +1,90 @@
+#ifndef __NUMA_TOPOLOGY__
+#define __NUMA_TOPOLOGY__
+
+#if _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+The NUMA nodes of the machine and the cpus that belong to each of them.
+On machines without NUMA (or when detection fails) there is a single node with every cpu.
+*/
+struct NumaTopology {
+	// nodeCpus[n] lists the cpu numbers of node n
+	std::vector<std::vector<int>> nodeCpus;
+
+	int nodes() const { return nodeCpus.size(); }
+
+	/*
+	Single node containing cpus 0 -> cores-1
+	*/
+	static NumaTopology uniform() {
+		NumaTopology topology;
+		int cores = std::max((int)std::thread::hardware_concurrency(), 1);
+		topology.nodeCpus.resize(1);
+		for (int i = 0; i < cores; i++) topology.nodeCpus[0].push_back(i);
+		return topology;
+	}
+
+	static NumaTopology detect() {
+		NumaTopology topology;
+#if _WIN32
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode)) {
+			for (USHORT node = 0; node <= highestNode; node++) {
+				GROUP_AFFINITY affinity;
+				if (!GetNumaNodeProcessorMaskEx(node, &affinity)) continue;
+				std::vector<int> cpus;
+				// only processor group 0 is used, like ThreadPool::pin
+				for (int bit = 0; affinity.Group == 0 && bit < 8 * sizeof(KAFFINITY); bit++)
+					if (affinity.Mask & ((KAFFINITY)1 << bit)) cpus.push_back(bit);
+				if (!cpus.empty()) topology.nodeCpus.push_back(cpus);
+			}
+		}
+#else
+		for (int node = 0; ; node++) {
+			std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			if (!in) break;
+			std::string list;
+			std::getline(in, list);
+			std::vector<int> cpus = parseCpuList(list);
+			if (!cpus.empty()) topology.nodeCpus.push_back(cpus);
+		}
+#endif
+		if (topology.nodeCpus.empty()) return uniform();
+		return topology;
+	}
+
+	/*
+	Parse a linux cpu list such as "0-3,8-11"
+	*/
+	static std::vector<int> parseCpuList(const std::string& list) {
+		std::vector<int> cpus;
+		std::stringstream ranges(list);
+		std::string range;
+		while (std::getline(ranges, range, ',')) {
+			try {
+				size_t dash = range.find('-');
+				int first = std::stoi(range.substr(0, dash));
+				int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+				for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+			}
+			catch (std::logic_error const& e) {
+				// ignore malformed entries (e.g. the empty list of a memory-only node)
+			}
+		}
+		return cpus;
+	}
+};
+
+#endif // NUMA_TOPOLOGY
@@ -0,0 +1,499 @@
+#ifndef __OBJ_LOADER__
+#define __OBJ_LOADER__
+
+#include <tucano/utils/objimporter.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "CompressedReader.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+
+/*
+Geometry of an OBJ file as it was read from disk, nothing is uploaded to OpenGL yet.
+Faces are grouped per usemtl statement like in Tucano::MeshImporter::loadObjFile.
+*/
+struct ObjData {
+	std::vector<Eigen::Vector4f> vertices;
+	std::vector<Eigen::Vector3f> normals;
+	std::vector<Eigen::Vector2f> texCoords;
+	std::vector<Eigen::Vector4f> colors;
+	// vertex indices (3 per triangle) of every group
+	std::vector<std::vector<GLuint>> groups;
+	// every usemtl statement: the group it applies to and the material name
+	std::vector<std::pair<int, std::string>> materialUses;
+	// the mtllib files, with the path of the OBJ file
+	std::vector<std::string> materialLibraries;
+};
+
+/*
+Reads OBJ files without touching OpenGL, so it can run on any thread.
+The file is memory mapped and cut into chunks at line boundaries, the chunks are parsed in
+parallel on the pool with a hand written (locale independent) number parser and then merged
+in file order. The result matches Tucano::MeshImporter::loadObjFile, except that polygons
+are split into triangles and vertex colors are only read when all three are present.
+Gzip compressed files (.obj.gz) are parsed chunk by chunk while they are being decompressed.
+*/
+class ObjLoader {
+private:
+	// Everything found in one chunk of the file
+	struct Chunk {
+		std::vector<Eigen::Vector4f> vertices;
+		std::vector<Eigen::Vector3f> normals;
+		std::vector<Eigen::Vector2f> texCoords;
+		std::vector<Eigen::Vector4f> colors;
+		std::vector<GLuint> indices;
+		// positions in indices of negative (relative) references, they count from the start of the chunk
+		std::vector<size_t> relativeIndices;
+		// usemtl statements: position in indices and material name
+		std::vector<std::pair<size_t, std::string>> materialUses;
+		std::vector<std::string> materialLibraries;
+	};
+
+	// Chunks are at least this large, smaller files are parsed on a single thread
+	static const size_t minimumChunkSize = 64 * 1024;
+
+public:
+	/*
+	Parse the OBJ file, exits when it cannot be opened (like the Tucano importer)
+	*/
+	static void parse(const std::string& filename, ObjData& data, ThreadPool* pool = nullptr) {
+		if (CompressedReader::isCompressed(filename)) {
+			parseCompressed(filename, data, pool);
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		MappedFile file;
+		if (!file.open(filename)) {
+			std::cerr << "Cannot open " << filename << std::endl;
+			exit(1);
+		}
+		int chunks = parseText(file.data(), file.data() + file.size(), filename, data, pool);
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		float megabytes = file.size() / (1024.0f * 1024.0f);
+		std::cout << "OBJ: " << filename << ", " << megabytes << " MB in " << seconds << " s ("
+			<< (seconds > 0 ? megabytes / seconds : 0.0f) << " MB/s, " << chunks << " chunks)" << std::endl;
+	}
+
+	/*
+	Parse the OBJ text [begin, end), returns the number of chunks it was split into
+	*/
+	static int parseText(const char* begin, const char* end, const std::string& filename, ObjData& data, ThreadPool* pool = nullptr) {
+		// cut the text into chunks that start at the beginning of a line
+		size_t size = end - begin;
+		int workers = pool != nullptr ? pool->size() : 1;
+		int count = (int)std::max<size_t>(1, std::min<size_t>(size / minimumChunkSize, workers * 4));
+		std::vector<const char*> bounds(count + 1, end);
+		bounds[0] = begin;
+		for (int c = 1; c < count; c++) {
+			const char* p = std::max(begin + size * c / count, bounds[c - 1]);
+			const char* newline = (const char*)memchr(p, '\n', end - p);
+			bounds[c] = newline != nullptr ? newline + 1 : end;
+		}
+
+		std::vector<Chunk> chunks(count);
+		auto parseOne = [&](int c) { parseChunk(bounds[c], bounds[c + 1], filename, chunks[c]); };
+		if (pool != nullptr) pool->parallelFor(0, count, parseOne);
+		else for (int c = 0; c < count; c++) parseOne(c);
+
+		merge(chunks, data, pool);
+		return count;
+	}
+
+	/*
+	Parse a gzip compressed OBJ file while it is decompressed on another thread: every decompressed
+	buffer is cut after its last newline and parsed as a chunk on the pool, the rest of the line is
+	carried over to the next buffer. At most a few chunks per worker wait to be parsed, so a slow
+	parse holds back the decompression instead of piling up text. Must not run on a worker of the pool.
+	*/
+	static void parseCompressed(const std::string& filename, ObjData& data, ThreadPool* pool = nullptr) {
+		auto start = std::chrono::steady_clock::now();
+		CompressedReader reader;
+		if (!reader.open(filename)) {
+			std::cerr << "Cannot read " << filename << ": " << reader.error() << std::endl;
+			exit(1);
+		}
+
+		// a deque, the chunks being parsed stay where they are while more are added
+		std::deque<Chunk> chunks;
+		std::vector<std::future<void>> parsing;
+		size_t waited = 0;
+		size_t maximumWaiting = pool != nullptr ? 2 * pool->size() : 0;
+		auto parseBlock = [&](std::string&& text) {
+			chunks.push_back(Chunk());
+			Chunk& chunk = chunks.back();
+			if (pool == nullptr) {
+				parseChunk(text.data(), text.data() + text.size(), filename, chunk);
+				return;
+			}
+			while (parsing.size() - waited >= maximumWaiting) parsing[waited++].get();
+			std::shared_ptr<std::string> block(new std::string(std::move(text)));
+			parsing.push_back(pool->submit([block, &chunk, &filename] {
+				parseChunk(block->data(), block->data() + block->size(), filename, chunk);
+			}));
+		};
+
+		std::string carry;
+		const char* p;
+		size_t size;
+		while (reader.next(p, size)) {
+			const char* lineEnd = p + size;
+			while (lineEnd > p && lineEnd[-1] != '\n') lineEnd--;
+			if (lineEnd == p) {
+				carry.append(p, size);
+				reader.release();
+				continue;
+			}
+			std::string text;
+			text.reserve(carry.size() + (lineEnd - p));
+			text.append(carry).append(p, lineEnd);
+			carry.assign(lineEnd, p + size);
+			reader.release();
+			parseBlock(std::move(text));
+		}
+		if (!carry.empty()) parseBlock(std::move(carry));
+		for (; waited < parsing.size(); waited++) parsing[waited].get();
+		if (!reader.finish()) {
+			std::cerr << "Cannot read " << filename << ": " << reader.error() << std::endl;
+			exit(1);
+		}
+
+		std::vector<Chunk> ordered(std::make_move_iterator(chunks.begin()), std::make_move_iterator(chunks.end()));
+		chunks.clear();
+		merge(ordered, data, pool);
+
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		float megabytes = reader.size() / (1024.0f * 1024.0f);
+		std::cout << "OBJ: " << filename << ", " << megabytes << " MB (" << reader.compressedSize() / (1024.0f * 1024.0f)
+			<< " MB compressed) in " << seconds << " s (" << (seconds > 0 ? megabytes / seconds : 0.0f) << " MB/s, "
+			<< ordered.size() << " chunks, decompressing took " << reader.seconds() << " s)" << std::endl;
+	}
+
+	/*
+	Find the first mtllib statement before the first face, so the materials can be read while
+	the rest of the file is still being parsed. Returns an empty string if there is none,
+	or if the file is compressed (then the full parse finds the libraries).
+	*/
+	static std::string findMaterialLibrary(const std::string& filename) {
+		if (CompressedReader::isCompressed(filename)) return "";
+		MappedFile file(filename);
+		const char* p = file.data();
+		const char* end = p + file.size();
+		while (p < end) {
+			const char* lineEnd = findLineEnd(p, end);
+			if (startsWith(p, lineEnd, "mtllib")) return materialLibraryPath(filename, std::string(p, lineEnd));
+			if (startsWith(p, lineEnd, "f ")) break;
+			p = lineEnd + 1;
+		}
+		return "";
+	}
+	/*
+	Material id of every group, resolved by name like the Tucano importer:
+	a usemtl with an unknown name keeps the previous material
+	*/
+	static std::vector<int> resolveMaterials(const ObjData& data, std::vector<Tucano::Material::Mtl>& materials) {
+		std::vector<int> groupMaterials(data.groups.size(), -1);
+		int current = -1;
+		for (const std::pair<int, std::string>& use : data.materialUses) {
+			for (int i = 0; i < materials.size(); ++i) {
+				if (materials[i].getName().compare(use.second) == 0) current = i;
+			}
+			groupMaterials[use.first] = current;
+		}
+		return groupMaterials;
+	}
+
+	/*
+	Plain grey material for faces that have none
+	*/
+	static Tucano::Material::Mtl defaultMaterial() {
+		Tucano::Material::Mtl mtl;
+		mtl.setName("default");
+		mtl.setAmbient(Eigen::Vector3f(0.1f, 0.1f, 0.1f));
+		mtl.setDiffuse(Eigen::Vector3f(0.6f, 0.6f, 0.6f));
+		mtl.setSpecular(Eigen::Vector3f(0.2f, 0.2f, 0.2f));
+		mtl.setShininess(20.0f);
+		mtl.setOpticalDensity(1.0f);
+		mtl.setDissolveFactor(1.0f);
+		mtl.setIlluminationModel(2);
+		return mtl;
+	}
+
+	/*
+	Vertex normals, computed the same way as the Tucano importer (added to the normals of the file)
+	*/
+	static void computeNormals(ObjData& data) {
+		Tucano::MeshImporter::computeNormals(data.vertices, data.groups, data.normals);
+	}
+
+	/*
+	Time the Tucano importer and this loader on the same file and print the throughput of both.
+	Needs the OpenGL context, the Tucano importer uploads the mesh. The time of this loader
+	includes the vertex normals, which the Tucano importer also computes.
+	*/
+	static void benchmark(const std::string& filename, ThreadPool* pool) {
+		if (CompressedReader::isCompressed(filename)) {
+			CompressedReader::benchmark(filename, [&] {
+				ObjData data;
+				parseCompressed(filename, data, pool);
+			});
+			return;
+		}
+		MappedFile file(filename);
+		if (file.data() == nullptr) {
+			std::cout << filename << ": cannot open" << std::endl;
+			return;
+		}
+		float megabytes = file.size() / (1024.0f * 1024.0f);
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			Tucano::Mesh mesh;
+			std::vector<Tucano::Material::Mtl> materials;
+			Tucano::MeshImporter::loadObjFile(mesh, materials, filename);
+		}
+		float tucanoSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		ObjData data;
+		parseText(file.data(), file.data() + file.size(), filename, data, pool);
+		computeNormals(data);
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << filename << " (" << megabytes << " MB): Tucano importer " << megabytes / tucanoSeconds << " MB/s, "
+			<< "parallel loader " << megabytes / seconds << " MB/s (" << tucanoSeconds / seconds << "x)" << std::endl;
+	}
+
+private:
+	static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+	static bool isSpace(char c) { return c == ' ' || c == '\t'; }
+
+	static const char* findLineEnd(const char* p, const char* end) {
+		const char* newline = (const char*)memchr(p, '\n', end - p);
+		return newline != nullptr ? newline : end;
+	}
+
+	static bool startsWith(const char* p, const char* lineEnd, const char* prefix) {
+		for (; *prefix != 0; ++p, ++prefix)
+			if (p >= lineEnd || *p != *prefix) return false;
+		return true;
+	}
+
+	static const char* skipSpaces(const char* p, const char* end) {
+		while (p < end && isSpace(*p)) p++;
+		return p;
+	}
+
+	/*
+	Parse a decimal number like 12, -0.5 or 1.5e-3, returns nullptr if there is none at p.
+	Up to 19 significant digits are exact, numbers with a small exponent are converted
+	with a single correctly rounded division or multiplication.
+	*/
+	static const char* parseFloat(const char* p, const char* end, float& value) {
+		static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+		unsigned long long mantissa = 0;
+		int digits = 0, exponent = 0;
+		bool any = false;
+		for (; p < end && isDigit(*p); p++) {
+			any = true;
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0) digits++;
+			}
+			else exponent++;
+		}
+		if (p < end && *p == '.') {
+			for (p++; p < end && isDigit(*p); p++) {
+				any = true;
+				if (digits < 19) {
+					mantissa = mantissa * 10 + (*p - '0');
+					if (mantissa != 0) digits++;
+					exponent--;
+				}
+			}
+		}
+		if (!any) return nullptr;
+
+		if (p < end && (*p == 'e' || *p == 'E')) {
+			const char* q = p + 1;
+			bool negativeExponent = false;
+			if (q < end && (*q == '-' || *q == '+')) negativeExponent = *q++ == '-';
+			int e = 0;
+			bool exponentDigits = false;
+			for (; q < end && isDigit(*q); q++) {
+				exponentDigits = true;
+				e = std::min(e * 10 + (*q - '0'), 100000);
+			}
+			if (exponentDigits) {
+				exponent += negativeExponent ? -e : e;
+				p = q;
+			}
+		}
+
+		double result;
+		if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+			result = exponent < 0 ? mantissa / powers[-exponent] : mantissa * powers[exponent];
+		else
+			result = (double)(mantissa * std::pow(10.0L, (long double)exponent));
+		value = (float)(negative ? -result : result);
+		return p;
+	}
+
+	static const char* parseInt(const char* p, const char* end, long long& value) {
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+		if (p >= end || !isDigit(*p)) return nullptr;
+		long long result = 0;
+		for (; p < end && isDigit(*p); p++) result = result * 10 + (*p - '0');
+		value = negative ? -result : result;
+		return p;
+	}
+
+	// Parse up to n numbers separated by spaces, returns how many were found
+	template <int n>
+	static int parseFloats(const char*& p, const char* end, float* values) {
+		for (int i = 0; i < n; i++) {
+			const char* next = parseFloat(skipSpaces(p, end), end, values[i]);
+			if (next == nullptr) return i;
+			p = next;
+		}
+		return n;
+	}
+
+	static void parseChunk(const char* p, const char* end, const std::string& filename, Chunk& chunk) {
+		std::vector<long long> polygon;
+		while (p < end) {
+			const char* lineEnd = findLineEnd(p, end);
+
+			if (startsWith(p, lineEnd, "v ")) {
+				const char* q = p + 2;
+				float v[3] = { 0, 0, 0 }, c[3];
+				parseFloats<3>(q, lineEnd, v);
+				chunk.vertices.push_back(Eigen::Vector4f(v[0], v[1], v[2], 1.0f));
+				if (parseFloats<3>(q, lineEnd, c) == 3)
+					chunk.colors.push_back(Eigen::Vector4f(c[0], c[1], c[2], 1.0f));
+			}
+			else if (startsWith(p, lineEnd, "f ")) {
+				// "f v/t/n ...", only the vertex ids are used for the faces
+				polygon.clear();
+				const char* q = skipSpaces(p + 2, lineEnd);
+				while (q < lineEnd && *q != '\r') {
+					long long id;
+					const char* next = parseInt(q, lineEnd, id);
+					if (next != nullptr) polygon.push_back(id);
+					else next = q + 1;
+					// skip the texture and normal ids
+					while (next < lineEnd && !isSpace(*next)) next++;
+					q = skipSpaces(next, lineEnd);
+				}
+				// split polygons into a fan of triangles
+				for (int i = 1; i + 1 < (int)polygon.size(); i++) {
+					addIndex(chunk, polygon[0]);
+					addIndex(chunk, polygon[i]);
+					addIndex(chunk, polygon[i + 1]);
+				}
+			}
+			else if (startsWith(p, lineEnd, "vn")) {
+				const char* q = p + 3;
+				float n[3] = { 0, 0, 0 };
+				if (q <= lineEnd) parseFloats<3>(q, lineEnd, n);
+				chunk.normals.push_back(Eigen::Vector3f(n[0], n[1], n[2]));
+			}
+			else if (startsWith(p, lineEnd, "vt")) {
+				const char* q = p + 2;
+				float t[2] = { 0, 0 };
+				parseFloats<2>(q, lineEnd, t);
+				chunk.texCoords.push_back(Eigen::Vector2f(t[0], t[1]));
+			}
+			else if (startsWith(p, lineEnd, "usemtl")) {
+				std::string line(p, lineEnd);
+				chunk.materialUses.push_back(std::make_pair(chunk.indices.size(), line.size() > 7 ? line.substr(7) : std::string()));
+			}
+			else if (startsWith(p, lineEnd, "mtllib")) {
+				chunk.materialLibraries.push_back(materialLibraryPath(filename, std::string(p, lineEnd)));
+			}
+			p = lineEnd + 1;
+		}
+	}
+
+	// OBJ ids start at 1, negative ids count back from the last vertex read so far
+	static void addIndex(Chunk& chunk, long long id) {
+		if (id < 0) {
+			chunk.relativeIndices.push_back(chunk.indices.size());
+			chunk.indices.push_back((GLuint)(chunk.vertices.size() + id));
+		}
+		else chunk.indices.push_back((GLuint)(id - 1));
+	}
+
+	template <typename T>
+	static void concatenate(std::vector<std::vector<T>*> parts, std::vector<T>& result, ThreadPool* pool) {
+		std::vector<size_t> offsets(parts.size() + 1, 0);
+		for (int c = 0; c < parts.size(); c++) offsets[c + 1] = offsets[c] + parts[c]->size();
+		result.resize(offsets.back());
+		auto copyOne = [&](int c) { std::copy(parts[c]->begin(), parts[c]->end(), result.begin() + offsets[c]); };
+		if (pool != nullptr) pool->parallelFor(0, parts.size(), copyOne);
+		else for (int c = 0; c < parts.size(); c++) copyOne(c);
+	}
+
+	/*
+	Append the chunks in file order, the faces are grouped per usemtl statement like the Tucano importer
+	*/
+	static void merge(std::vector<Chunk>& chunks, ObjData& data, ThreadPool* pool) {
+		std::vector<std::vector<Eigen::Vector4f>*> vertices, colors;
+		std::vector<std::vector<Eigen::Vector3f>*> normals;
+		std::vector<std::vector<Eigen::Vector2f>*> texCoords;
+		std::vector<GLuint> vertexOffsets;
+		GLuint vertexCount = 0;
+		for (Chunk& c : chunks) {
+			vertices.push_back(&c.vertices);
+			colors.push_back(&c.colors);
+			normals.push_back(&c.normals);
+			texCoords.push_back(&c.texCoords);
+			vertexOffsets.push_back(vertexCount);
+			vertexCount += c.vertices.size();
+		}
+		concatenate(vertices, data.vertices, pool);
+		concatenate(colors, data.colors, pool);
+		concatenate(normals, data.normals, pool);
+		concatenate(texCoords, data.texCoords, pool);
+
+		// first group, we do not know yet whether the file uses materials
+		data.groups.push_back(std::vector<GLuint>());
+		for (int c = 0; c < chunks.size(); c++) {
+			Chunk& chunk = chunks[c];
+			for (size_t i : chunk.relativeIndices) chunk.indices[i] += vertexOffsets[c];
+
+			size_t done = 0;
+			for (const std::pair<size_t, std::string>& use : chunk.materialUses) {
+				data.groups.back().insert(data.groups.back().end(), chunk.indices.begin() + done, chunk.indices.begin() + use.first);
+				done = use.first;
+				// start a new group, unless the last one is still empty
+				if (!data.groups.back().empty()) data.groups.push_back(std::vector<GLuint>());
+				data.materialUses.push_back(std::make_pair((int)data.groups.size() - 1, use.second));
+			}
+			data.groups.back().insert(data.groups.back().end(), chunk.indices.begin() + done, chunk.indices.end());
+			data.materialLibraries.insert(data.materialLibraries.end(), chunk.materialLibraries.begin(), chunk.materialLibraries.end());
+		}
+	}
+
+	static std::string materialLibraryPath(const std::string& filename, const std::string& line) {
+		std::string path = Tucano::MeshImporter::getPathName(filename) + (line.size() > 7 ? line.substr(7) : std::string());
+		// remove newline or carriage return characters from the end
+		path.erase(std::remove(path.begin(), path.end(), '\n'), path.end());
+		path.erase(std::remove(path.begin(), path.end(), '\r'), path.end());
+		return path;
+	}
+};
+
+#endif // OBJ_LOADER
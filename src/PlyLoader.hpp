@@ -0,0 +1,587 @@
+#ifndef __PLY_LOADER__
+#define __PLY_LOADER__
+
+#include <tucano/utils/plyimporter.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "CompressedReader.hpp"
+#include "MappedFile.hpp"
+#include "ObjLoader.hpp"
+#include "ThreadPool.hpp"
+
+/*
+Reads PLY files into an ObjData (one group of faces without a material), without touching OpenGL.
+Binary little endian files are copied straight out of the memory mapped file: the vertex block
+in parallel ranges and, when every face is a triangle, the face block as well. Other files go
+through the rply callbacks Tucano::MeshImporter::loadPlyFile uses, with the same results, except
+that polygons are split into triangles (the Tucano importer only keeps their first three vertices).
+Gzip compressed files (.ply.gz) are copied the same way out of every buffer as it is decompressed,
+rply can only read from a file so they have to be binary little endian.
+*/
+class PlyLoader {
+private:
+	enum Type { Invalid, Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+	struct Property {
+		std::string name;
+		Type type = Invalid;		// type of the items for a list
+		Type countType = Invalid;	// Invalid for a scalar property
+		size_t offset = 0;			// from the start of the instance, only for elements without lists
+	};
+
+	struct Element {
+		std::string name;
+		size_t count = 0;
+		std::vector<Property> properties;
+		size_t stride = 0;			// bytes per instance, 0 when the element has a list
+
+		int find(const std::string& property) const {
+			for (int i = 0; i < properties.size(); ++i)
+				if (properties[i].name == property) return i;
+			return -1;
+		}
+	};
+
+	struct Header {
+		std::string format;
+		std::vector<Element> elements;
+		size_t size = 0;			// bytes up to and including the end_header line
+	};
+
+	// Faces read by the rply callback
+	struct Polygons {
+		std::vector<GLuint> indices;
+		std::vector<GLuint> polygon;	// the face being read
+	};
+
+	// Vertices and faces are copied in ranges of at least this many instances
+	static const int minimumRange = 16 * 1024;
+
+	// Headers longer than this are not PLY files
+	static const size_t maximumHeaderSize = 1024 * 1024;
+
+	/*
+	Copies the vertices and faces of a binary little endian file out of consecutive blocks of it,
+	the whole file at once when it is mapped or one decompressed buffer after the other
+	*/
+	class BinaryReader {
+	private:
+		ObjData& data;
+		ThreadPool* pool;
+		Header fileHeader;
+		bool headerRead = false;
+		size_t element = 0;		// being read
+		size_t instance = 0;	// of the element, the next one to read
+		std::vector<GLuint> indices;
+
+		// properties of the element being read
+		int x, y, z, nx, ny, nz, red, green, blue;
+		Type countType, indexType;
+
+	public:
+		BinaryReader(ObjData& _data, ThreadPool* _pool) : data(_data), pool(_pool) {}
+
+		const Header& header() const { return fileHeader; }
+
+		// Whether the header was read and is one of a binary little endian file
+		bool binary() const { return headerRead; }
+
+		/*
+		Copy what is complete of the file part [p, end), which starts where the previous call stopped.
+		Returns where it stopped: the start of an unfinished header or instance that has to be passed
+		again together with the bytes after it, or nullptr if the file cannot be copied.
+		*/
+		const char* read(const char* p, const char* end) {
+			if (!headerRead) {
+				// an incomplete header is read again with more of the file
+				Header header;
+				if (!readHeader(p, end - p, header)) return (size_t)(end - p) > maximumHeaderSize ? nullptr : p;
+				fileHeader = header;
+				if (fileHeader.format != "binary_little_endian" || !littleEndianMachine()) return nullptr;
+				headerRead = true;
+				p += fileHeader.size;
+				if (!startElement()) return nullptr;
+			}
+			while (element < fileHeader.elements.size()) {
+				p = readInstances(fileHeader.elements[element], p, end);
+				if (p == nullptr) return nullptr;
+				if (instance < fileHeader.elements[element].count) return p;
+				element++;
+				instance = 0;
+				if (!startElement()) return nullptr;
+			}
+			// anything after the last element is ignored
+			return end;
+		}
+
+		/*
+		After the last part: store the faces, returns false if the file ended too early
+		*/
+		bool finish() {
+			if (!headerRead || element < fileHeader.elements.size()) return false;
+			data.groups.assign(1, std::move(indices));
+			return true;
+		}
+
+	private:
+		bool startElement() {
+			if (element == fileHeader.elements.size()) return true;
+			const Element& e = fileHeader.elements[element];
+			if (e.name == "vertex") {
+				x = e.find("x"); y = e.find("y"); z = e.find("z");
+				nx = e.find("nx"); ny = e.find("ny"); nz = e.find("nz");
+				red = e.find("red"); green = e.find("green"); blue = e.find("blue");
+				if (e.stride == 0 || x < 0 || y < 0 || z < 0) return false;
+				data.vertices.resize(e.count);
+				if (nx >= 0 && ny >= 0 && nz >= 0) data.normals.resize(e.count);
+				if (red >= 0 && green >= 0 && blue >= 0) data.colors.resize(e.count);
+			}
+			else if (e.name == "face") {
+				int list = e.find("vertex_indices");
+				if (list < 0) list = e.find("vertex_index");
+				if (list < 0 || e.properties.size() != 1) return false;
+				countType = e.properties[list].countType;
+				indexType = e.properties[list].type;
+				if (countType == Invalid || indexType == Float32 || indexType == Float64) return false;
+			}
+			return true;
+		}
+
+		const char* readInstances(const Element& e, const char* p, const char* end) {
+			size_t left = e.count - instance;
+			if (e.name == "vertex") {
+				size_t n = std::min(left, (size_t)(end - p) / e.stride);
+				const std::vector<Property>& props = e.properties;
+				auto value = [&](const char* v, int property) {
+					return (float)readValue(v + props[property].offset, props[property].type);
+				};
+				// the same conversion as the rply color callback
+				auto channel = [&](const char* v, int property) {
+					float c = value(v, property);
+					if (c > 1.0) c /= 255.0;
+					return c;
+				};
+				bool normals = !data.normals.empty(), colors = !data.colors.empty();
+				size_t first = instance;
+				forRanges(pool, n, [&](size_t begin, size_t last) {
+					for (size_t i = begin; i < last; ++i) {
+						const char* v = p + i * e.stride;
+						data.vertices[first + i] = Eigen::Vector4f(value(v, x), value(v, y), value(v, z), 1.0f);
+						if (normals) data.normals[first + i] = Eigen::Vector3f(value(v, nx), value(v, ny), value(v, nz));
+						if (colors) data.colors[first + i] = Eigen::Vector4f(channel(v, red), channel(v, green), channel(v, blue), 1.0f);
+					}
+				});
+				instance += n;
+				return p + n * e.stride;
+			}
+			if (e.name == "face") {
+				size_t countSize = typeSize(countType), indexSize = typeSize(indexType);
+
+				// triangles only: every face has the same size, so the complete ones are copied in parallel ranges
+				size_t stride = countSize + 3 * indexSize;
+				size_t n = std::min(left, (size_t)(end - p) / stride);
+				if (n > 0) {
+					size_t first = indices.size();
+					std::atomic<bool> triangles(true);
+					indices.resize(first + 3 * n);
+					forRanges(pool, n, [&](size_t begin, size_t last) {
+						for (size_t i = begin; i < last && triangles; ++i) {
+							const char* f = p + i * stride;
+							if (readValue(f, countType) != 3) triangles = false;
+							for (int k = 0; k < 3; ++k)
+								indices[first + 3 * i + k] = (GLuint)readValue(f + countSize + k * indexSize, indexType);
+						}
+					});
+					if (triangles) {
+						instance += n;
+						p += n * stride;
+					}
+					else indices.resize(first);
+				}
+
+				// polygons: walk the faces one by one and split them into fans
+				while (instance < e.count) {
+					if ((size_t)(end - p) < countSize) break;
+					size_t count = (size_t)readValue(p, countType);
+					const char* f = p + countSize;
+					if ((size_t)(end - f) / indexSize < count) break;
+					for (size_t k = 2; k < count; ++k) {
+						indices.push_back((GLuint)readValue(f, indexType));
+						indices.push_back((GLuint)readValue(f + (k - 1) * indexSize, indexType));
+						indices.push_back((GLuint)readValue(f + k * indexSize, indexType));
+					}
+					p = f + count * indexSize;
+					instance++;
+				}
+				return p;
+			}
+
+			// some other element, skipped
+			if (e.stride > 0) {
+				size_t n = std::min(left, (size_t)(end - p) / e.stride);
+				instance += n;
+				return p + n * e.stride;
+			}
+			for (; instance < e.count; ++instance) {
+				size_t size = instanceSize(e, p, end);
+				if (size == 0) break;
+				p += size;
+			}
+			return p;
+		}
+	};
+
+public:
+	// PLY files are recognized by their extension, also when compressed
+	static bool isPly(const std::string& name) {
+		std::string filename = CompressedReader::uncompressedName(name);
+		std::string extension = ".ply";
+		return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+	}
+
+	/*
+	Read the PLY file, exits when it cannot be read (like the OBJ loader)
+	*/
+	static void parse(const std::string& filename, ObjData& data, ThreadPool* pool = nullptr) {
+		if (CompressedReader::isCompressed(filename)) {
+			parseCompressed(filename, data, pool);
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		MappedFile file;
+		if (!file.open(filename)) {
+			std::cerr << "Cannot open " << filename << std::endl;
+			exit(1);
+		}
+		BinaryReader binary(data, pool);
+		bool bulk = binary.read(file.data(), file.data() + file.size()) != nullptr && binary.finish();
+		if (!bulk) {
+			data = ObjData();
+			if (!readWithCallbacks(filename, data)) {
+				std::cerr << "Cannot read " << filename << std::endl;
+				exit(1);
+			}
+		}
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		float megabytes = file.size() / (1024.0f * 1024.0f);
+		std::cout << "PLY: " << filename << ", " << megabytes << " MB in " << seconds << " s ("
+			<< (seconds > 0 ? megabytes / seconds : 0.0f) << " MB/s, " << (bulk ? "bulk copy" : "rply callbacks") << ")" << std::endl;
+	}
+
+	/*
+	Read a gzip compressed PLY file while it is decompressed on another thread: the complete vertices
+	and faces of every decompressed buffer are copied out of it right away, only the start of an
+	instance cut by the end of the buffer is carried over to the next one
+	*/
+	static void parseCompressed(const std::string& filename, ObjData& data, ThreadPool* pool = nullptr) {
+		auto start = std::chrono::steady_clock::now();
+		CompressedReader reader;
+		if (!reader.open(filename)) {
+			std::cerr << "Cannot read " << filename << ": " << reader.error() << std::endl;
+			exit(1);
+		}
+
+		BinaryReader binary(data, pool);
+		std::vector<char> carry;
+		bool copied = true;
+		const char* p;
+		size_t size;
+		while (copied && reader.next(p, size)) {
+			const char* end = p + size;
+			// complete the carried instance with the start of this buffer, taking more the longer it is
+			while (copied && !carry.empty() && p < end) {
+				size_t carried = carry.size();
+				size_t take = std::min((size_t)(end - p), std::max(carried, (size_t)4096));
+				carry.insert(carry.end(), p, p + take);
+				const char* stop = binary.read(carry.data(), carry.data() + carry.size());
+				copied = stop != nullptr;
+				if (!copied) break;
+				size_t used = stop - carry.data();
+				if (used >= carried) {
+					p += used - carried;
+					carry.clear();
+				}
+				else {
+					carry.erase(carry.begin(), carry.begin() + used);
+					p += take;
+				}
+			}
+			if (copied && carry.empty()) {
+				const char* stop = binary.read(p, end);
+				copied = stop != nullptr;
+				if (copied) carry.assign(stop, end);
+			}
+			reader.release();
+		}
+		if (!copied) {
+			reader.cancel();
+			std::cerr << "Cannot read " << filename << ": " << (binary.binary() ? "the vertices or faces cannot be read" :
+				binary.header().size == 0 ? "not a PLY file" : "compressed PLY files have to be binary little endian") << std::endl;
+			exit(1);
+		}
+		if (!reader.finish()) {
+			std::cerr << "Cannot read " << filename << ": " << reader.error() << std::endl;
+			exit(1);
+		}
+		if (!binary.finish()) {
+			std::cerr << "Cannot read " << filename << ": " << (binary.binary() ? "the file ends too early" : "not a PLY file") << std::endl;
+			exit(1);
+		}
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+		float megabytes = reader.size() / (1024.0f * 1024.0f);
+		std::cout << "PLY: " << filename << ", " << megabytes << " MB (" << reader.compressedSize() / (1024.0f * 1024.0f)
+			<< " MB compressed) in " << seconds << " s (" << (seconds > 0 ? megabytes / seconds : 0.0f) << " MB/s, "
+			<< "decompressing took " << reader.seconds() << " s)" << std::endl;
+	}
+
+	/*
+	Time the rply callbacks and this loader on the same file and print the throughput of both
+	*/
+	static void benchmark(const std::string& filename, ThreadPool* pool) {
+		if (CompressedReader::isCompressed(filename)) {
+			CompressedReader::benchmark(filename, [&] {
+				ObjData data;
+				parseCompressed(filename, data, pool);
+			});
+			return;
+		}
+		MappedFile file(filename);
+		if (file.data() == nullptr) {
+			std::cout << filename << ": cannot open" << std::endl;
+			return;
+		}
+		float megabytes = file.size() / (1024.0f * 1024.0f);
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			ObjData data;
+			readWithCallbacks(filename, data);
+		}
+		float callbackSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+		start = std::chrono::steady_clock::now();
+		ObjData data;
+		BinaryReader binary(data, pool);
+		bool bulk = binary.read(file.data(), file.data() + file.size()) != nullptr && binary.finish();
+		float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << filename << " (" << megabytes << " MB): rply callbacks " << megabytes / callbackSeconds << " MB/s, ";
+		if (bulk) std::cout << "bulk copy " << megabytes / seconds << " MB/s (" << callbackSeconds / seconds << "x)" << std::endl;
+		else std::cout << "no bulk copy (" << binary.header().format << ")" << std::endl;
+	}
+
+private:
+	static Type typeFromName(const std::string& name) {
+		if (name == "char" || name == "int8") return Int8;
+		if (name == "uchar" || name == "uint8") return UInt8;
+		if (name == "short" || name == "int16") return Int16;
+		if (name == "ushort" || name == "uint16") return UInt16;
+		if (name == "int" || name == "int32") return Int32;
+		if (name == "uint" || name == "uint32") return UInt32;
+		if (name == "float" || name == "float32") return Float32;
+		if (name == "double" || name == "float64") return Float64;
+		return Invalid;
+	}
+
+	static size_t typeSize(Type type) {
+		switch (type) {
+		case Int8: case UInt8: return 1;
+		case Int16: case UInt16: return 2;
+		case Int32: case UInt32: case Float32: return 4;
+		case Float64: return 8;
+		default: return 0;
+		}
+	}
+
+	// Value of a little endian scalar, p does not have to be aligned
+	static double readValue(const char* p, Type type) {
+		switch (type) {
+		case Int8: { int8_t v; std::memcpy(&v, p, 1); return v; }
+		case UInt8: { uint8_t v; std::memcpy(&v, p, 1); return v; }
+		case Int16: { int16_t v; std::memcpy(&v, p, 2); return v; }
+		case UInt16: { uint16_t v; std::memcpy(&v, p, 2); return v; }
+		case Int32: { int32_t v; std::memcpy(&v, p, 4); return v; }
+		case UInt32: { uint32_t v; std::memcpy(&v, p, 4); return v; }
+		case Float32: { float v; std::memcpy(&v, p, 4); return v; }
+		case Float64: { double v; std::memcpy(&v, p, 8); return v; }
+		default: return 0;
+		}
+	}
+
+	static bool littleEndianMachine() {
+		uint16_t one = 1;
+		unsigned char first;
+		std::memcpy(&first, &one, 1);
+		return first == 1;
+	}
+
+	/*
+	Read the header at the start of the file, returns false if it is not a valid PLY header
+	*/
+	static bool readHeader(const char* begin, size_t size, Header& header) {
+		const char* end = begin + size;
+		const char* p = begin;
+		bool first = true;
+		while (p < end) {
+			const char* newline = (const char*)memchr(p, '\n', end - p);
+			if (newline == nullptr) return false;
+			std::istringstream line(std::string(p, newline));
+			p = newline + 1;
+
+			std::string keyword;
+			line >> keyword;
+			if (first) {
+				if (keyword != "ply") return false;
+				first = false;
+			}
+			else if (keyword == "format") line >> header.format;
+			else if (keyword == "element") {
+				Element element;
+				line >> element.name >> element.count;
+				if (!line) return false;
+				header.elements.push_back(element);
+			}
+			else if (keyword == "property") {
+				if (header.elements.empty()) return false;
+				Property property;
+				std::string type;
+				line >> type;
+				if (type == "list") {
+					std::string countType, itemType;
+					line >> countType >> itemType;
+					property.countType = typeFromName(countType);
+					property.type = typeFromName(itemType);
+					if (property.countType == Invalid) return false;
+				}
+				else property.type = typeFromName(type);
+				line >> property.name;
+				if (!line || property.type == Invalid) return false;
+				header.elements.back().properties.push_back(property);
+			}
+			else if (keyword == "end_header") {
+				header.size = p - begin;
+				break;
+			}
+		}
+		if (header.size == 0) return false;
+
+		// offsets within the instances of elements without lists
+		for (Element& element : header.elements) {
+			size_t offset = 0;
+			for (Property& property : element.properties) {
+				if (property.countType != Invalid) {
+					offset = 0;
+					break;
+				}
+				property.offset = offset;
+				offset += typeSize(property.type);
+			}
+			element.stride = offset;
+		}
+		return true;
+	}
+
+	// Size in bytes of one instance of an element with lists
+	static size_t instanceSize(const Element& element, const char* p, const char* end) {
+		const char* start = p;
+		for (const Property& property : element.properties) {
+			if (property.countType == Invalid) {
+				p += typeSize(property.type);
+				continue;
+			}
+			if (p + typeSize(property.countType) > end) return 0;
+			size_t count = (size_t)readValue(p, property.countType);
+			p += typeSize(property.countType) + count * typeSize(property.type);
+		}
+		return p <= end ? p - start : 0;
+	}
+
+	/*
+	Call copy on ranges of [0, count), on the pool when there are enough for more than one range
+	*/
+	static void forRanges(ThreadPool* pool, size_t count, const std::function<void(size_t, size_t)>& copy) {
+		size_t ranges = std::max((size_t)1, std::min(count / minimumRange, (size_t)(pool != nullptr ? pool->size() * 4 : 1)));
+		auto copyRange = [&](int r) { copy(count * r / ranges, count * (r + 1) / ranges); };
+		if (pool != nullptr && ranges > 1) pool->parallelFor(0, (int)ranges, copyRange);
+		else for (size_t r = 0; r < ranges; ++r) copyRange((int)r);
+	}
+
+	/*
+	Read any PLY file with the rply callbacks of the Tucano importer
+	*/
+	static bool readWithCallbacks(const std::string& filename, ObjData& data) {
+		p_ply ply = ply_open(filename.c_str(), NULL, 0, NULL);
+		if (!ply) return false;
+		if (!ply_read_header(ply)) {
+			ply_close(ply);
+			return false;
+		}
+
+		Polygons faces;
+		ply_set_read_cb(ply, "vertex", "x", Tucano::MeshImporter::vertex_cb, (void*)&data.vertices, 0);
+		ply_set_read_cb(ply, "vertex", "y", Tucano::MeshImporter::vertex_cb, (void*)&data.vertices, 1);
+		ply_set_read_cb(ply, "vertex", "z", Tucano::MeshImporter::vertex_cb, (void*)&data.vertices, 2);
+		ply_set_read_cb(ply, "vertex", "red", Tucano::MeshImporter::color_cb, (void*)&data.colors, 0);
+		ply_set_read_cb(ply, "vertex", "green", Tucano::MeshImporter::color_cb, (void*)&data.colors, 1);
+		ply_set_read_cb(ply, "vertex", "blue", Tucano::MeshImporter::color_cb, (void*)&data.colors, 2);
+		ply_set_read_cb(ply, "vertex", "nx", Tucano::MeshImporter::normal_cb, (void*)&data.normals, 0);
+		ply_set_read_cb(ply, "vertex", "ny", Tucano::MeshImporter::normal_cb, (void*)&data.normals, 1);
+		ply_set_read_cb(ply, "vertex", "nz", Tucano::MeshImporter::normal_cb, (void*)&data.normals, 2);
+		// the same face lists the bulk path accepts
+		if (ply_set_read_cb(ply, "face", "vertex_indices", faceCallback, (void*)&faces, 0) == 0
+			&& ply_set_read_cb(ply, "face", "vertex_index", faceCallback, (void*)&faces, 0) == 0 && faceCount(ply) > 0) {
+			std::cerr << filename << ": the faces have no vertex_indices list" << std::endl;
+			ply_close(ply);
+			return false;
+		}
+
+		bool read = ply_read(ply) != 0;
+		ply_close(ply);
+		data.groups.assign(1, faces.indices);
+		return read;
+	}
+
+	// Number of faces in the header, 0 without a face element
+	static long faceCount(p_ply ply) {
+		for (p_ply_element element = ply_get_next_element(ply, NULL); element != NULL; element = ply_get_next_element(ply, element)) {
+			const char* name;
+			long instances;
+			ply_get_element_info(element, &name, &instances);
+			if (std::string(name) == "face") return instances;
+		}
+		return 0;
+	}
+
+	// Collects the vertices of a face and splits it into a fan of triangles after the last one
+	static int faceCallback(p_ply_argument argument) {
+		long length, index;
+		void* data;
+		ply_get_argument_property(argument, NULL, &length, &index);
+		ply_get_argument_user_data(argument, &data, NULL);
+		Polygons& faces = *static_cast<Polygons*>(data);
+
+		// index -1 is the length of the list
+		if (index < 0) {
+			faces.polygon.clear();
+			return 1;
+		}
+		faces.polygon.push_back((GLuint)ply_get_argument_value(argument));
+		if (index == length - 1) {
+			for (size_t k = 2; k < faces.polygon.size(); ++k) {
+				faces.indices.push_back(faces.polygon[0]);
+				faces.indices.push_back(faces.polygon[k - 1]);
+				faces.indices.push_back(faces.polygon[k]);
+			}
+		}
+		return 1;
+	}
+};
+
+#endif // PLY_LOADER
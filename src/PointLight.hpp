@@ -9,7 +9,7 @@
 
 class PointLight : public SphereLight {
 public:
-	PointLight(Eigen::Vector3f _position, Eigen::Vector3f _color) : SphereLight(_position, _color, 0) {
+	PointLight(Eigen::Vector3f _position, Eigen::Vector3f _color) : SphereLight(_position, _color, 0, 0) {
 		this->setShapeAttributes(SPHERE_RADIUS, POINT_ALPHA);
 	}
 };
@@ -0,0 +1,75 @@
+#ifndef __RAY_COUNTERS__
+#define __RAY_COUNTERS__
+
+#include <array>
+#include <atomic>
+#include <iostream>
+
+/*
+Number of rays traced per kind and of the box and triangle tests they needed.
+Every render thread counts in its own copy (see RayCounters::local()) without any locking or
+atomics, flush() adds them to the totals once the thread is done with a render.
+*/
+class RayCounters {
+public:
+	enum Kind { Primary, Shadow, Reflection, BoxTests, BoxHits, TriangleTests, KindCount };
+
+	typedef std::array<unsigned long long, KindCount> Counts;
+
+	// only grow until flush(), so the difference of two copies is what was traced in between
+	Counts counts = {};
+
+	RayCounters() {}
+
+	~RayCounters() { flush(); }
+
+	/*
+	The counters of the calling thread
+	*/
+	static RayCounters& local() {
+		thread_local RayCounters counters;
+		return counters;
+	}
+
+	void add(Kind kind, unsigned long long n = 1) { counts[kind] += n; }
+
+	/*
+	Add the counters of this thread to the totals
+	*/
+	void flush() {
+		for (int k = 0; k < KindCount; k++) {
+			totals()[k] += counts[k];
+			counts[k] = 0;
+		}
+	}
+
+	static void resetStatistics() {
+		for (int k = 0; k < KindCount; k++) totals()[k] = 0;
+	}
+
+	static unsigned long long get(Kind kind) { return totals()[kind]; }
+
+	/*
+	Print the totals, with the rays per second over the given wall time of the render
+	*/
+	static void printStatistics(float seconds) {
+		static const char* names[] = { "primary", "shadow", "reflection" };
+		unsigned long long rays = get(Primary) + get(Shadow) + get(Reflection);
+		std::cout << "Rays: " << rays << " (" << megaPerSecond(rays, seconds) << " Mrays/s)";
+		for (int k = Primary; k <= Reflection; k++)
+			std::cout << ", " << names[k] << " " << get((Kind)k) << " (" << megaPerSecond(get((Kind)k), seconds) << " Mrays/s)";
+		std::cout << std::endl;
+		std::cout << "Tests: " << get(BoxTests) << " boxes (" << get(BoxHits) << " hit), " << get(TriangleTests) << " triangles ("
+			<< (rays > 0 ? (float)get(TriangleTests) / rays : 0.0f) << " triangles per ray)" << std::endl;
+	}
+
+private:
+	static std::atomic<unsigned long long>* totals() {
+		static std::atomic<unsigned long long> counters[KindCount];
+		return counters;
+	}
+
+	static float megaPerSecond(unsigned long long n, float seconds) { return seconds > 0.0f ? n / seconds / 1e6f : 0.0f; }
+};
+
+#endif // RAY_COUNTERS
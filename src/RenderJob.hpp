@@ -0,0 +1,82 @@
+#ifndef __RENDER_JOB__
+#define __RENDER_JOB__
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+
+/*
+Handle of a render running in the background.
+The render reports its progress through advance() and checks cancelled() between units of work,
+the viewer polls progress() and can cancel() it. A job may wait in the queue of the render thread
+(behind the scene build or an older render), it calls start() first and skips the render if it was
+cancelled meanwhile. The completion callback is called on the render
+thread once the job has finished or has been cancelled, so it must not use OpenGL.
+*/
+class RenderJob {
+public:
+	enum class State { Running, Finished, Cancelled };
+
+	typedef std::function<void(RenderJob&)> Callback;
+
+private:
+	std::atomic<int> finishedWork;
+	std::atomic<int> totalWork;
+	std::atomic<bool> cancelRequested;
+	std::atomic<bool> startedRender;
+	std::atomic<State> currentState;
+	Callback onComplete;
+	std::shared_future<void> done;
+
+public:
+	RenderJob(Callback _onComplete = Callback())
+		: finishedWork(0), totalWork(1), cancelRequested(false), startedRender(false), currentState(State::Running), onComplete(_onComplete) {}
+
+	RenderJob(const RenderJob&) = delete;
+	RenderJob& operator=(const RenderJob&) = delete;
+
+	// Called by the render, the work is counted in whatever unit it uses (tiles, columns)
+	void setTotalWork(int total) { totalWork = total > 0 ? total : 1; finishedWork = 0; }
+	void advance(int work = 1) { finishedWork += work; }
+
+	// Fraction (0 -> 1) of the work that is done
+	float progress() const { return std::min(1.0f, (float)finishedWork / totalWork); }
+
+	// Ask the render to stop, it does so after the tile (or column) it is working on
+	void cancel() { cancelRequested = true; }
+	bool cancelled() const { return cancelRequested; }
+
+	/*
+	Called by the render thread when the job leaves the queue, returns false if it was cancelled before
+	(either this returns false or a cancel() that returned before it sees started())
+	*/
+	bool start() {
+		startedRender = true;
+		return !cancelRequested;
+	}
+	bool started() const { return startedRender; }
+
+	State state() const { return currentState; }
+	bool running() const { return currentState == State::Running; }
+
+	// Future of the task running the render, set by whoever started it
+	void setFuture(std::future<void>&& future) { done = future.share(); }
+
+	/*
+	Block until the render has finished or stopped after being cancelled
+	*/
+	void wait() const {
+		if (done.valid()) done.wait();
+	}
+
+	/*
+	Called by the render thread at the very end
+	*/
+	void complete(bool finished) {
+		currentState = finished ? State::Finished : State::Cancelled;
+		if (onComplete) onComplete(*this);
+	}
+};
+
+#endif // RENDER_JOB
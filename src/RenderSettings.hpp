@@ -0,0 +1,197 @@
+#ifndef __RENDER_SETTINGS__
+#define __RENDER_SETTINGS__
+
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cfloat>
+#include "TracePolicy.hpp"
+
+/*
+Tuning parameters of the ray tracer, read from a config file and/or the command line.
+Both use the same keys, a config file has one "key = value" per line (# starts a comment)
+and on the command line they are passed as --key=value.
+Flyscene keeps its own const copy, so the values cannot change once a render has started.
+*/
+struct RenderSettings {
+	// Scene that is loaded on startup: an OBJ or PLY file (also gzip compressed, .obj.gz) or a compiled .rtscene file
+	std::string model = "resources/models/scene5.obj";
+	// Write the loaded scene to this .rtscene file and exit (empty: start the viewer)
+	std::string compileScene;
+	// Check every id in a compiled scene when it is opened, which reads the whole file (a compiled scene is always checked after it is written)
+	bool verifyScene = false;
+	// Maximum number of reflections of a ray
+	int maxRecursiveDepth = 2;
+	// A box of the acceleration structure with more faces than this is split
+	int maxFacesPerBox = 50;
+	// Maximum overlap (0 -> 1) allowed between two boxes created by a split
+	float maxOverlap = 0.2f;
+	// Let the number of sampling points depend on the radius (larger sphere light -> more samples)
+	float samplingPointsPerRadius = 80;
+	// Average 2x2 pixel blocks of the ray traced image (anti-aliasing)
+	bool supersampling = true;
+	// Trace the image on multiple threads
+	bool multithreading = false;
+	// Number of worker threads, 0 uses every core
+	int threads = 0;
+	// Pin every worker thread to its own core
+	bool pinThreads = true;
+	// Spread the workers over the NUMA nodes and give every node its own copy of the scene
+	bool numa = false;
+	// Width and height in pixels of the tiles handed to the render threads
+	int tileSize = 16;
+	// Kernel used for ray tracing
+	TraceVariant kernel = TraceVariant::Production;
+	// Trace out of core: the faces are written to pageFile and read back through a cache of this many MB (0: keep them in memory)
+	int pageCacheMb = 0;
+	std::string pageFile = "scene.pages";
+	// Weld vertices, drop degenerate and duplicate faces and sort the faces along a Morton curve before building the boxes
+	bool preprocessGeometry = true;
+	// Vertices closer than this are welded (0: only vertices at the same position)
+	float weldTolerance = 0.0f;
+	// Also write the boxes hit, triangles tested and shadow rays of every pixel as false color images next to result.ppm
+	bool costImages = false;
+	// Compact geometry: 16-bit vertex positions and normals, decoded while tracing
+	bool quantizeVertices = false;
+
+	/*
+	Set a single value, throws std::invalid_argument for an unknown key or invalid value
+	(std::stoi/stof can also throw std::out_of_range)
+	*/
+	void set(const std::string& key, const std::string& value) {
+		if (key == "model") model = value;
+		else if (key == "compile_scene") compileScene = value;
+		else if (key == "verify_scene") verifyScene = parseBool(value);
+		else if (key == "max_recursive_depth") maxRecursiveDepth = parseInt(value, 0);
+		else if (key == "max_faces_per_box") maxFacesPerBox = parseInt(value, 1);
+		else if (key == "max_overlap") maxOverlap = parseFloat(value, 0.0f, 1.0f);
+		else if (key == "sampling_points_per_radius") samplingPointsPerRadius = parseFloat(value, 0.0f, FLT_MAX);
+		else if (key == "supersampling") supersampling = parseBool(value);
+		else if (key == "multithreading") multithreading = parseBool(value);
+		else if (key == "threads") threads = parseInt(value, 0);
+		else if (key == "pin_threads") pinThreads = parseBool(value);
+		else if (key == "numa") numa = parseBool(value);
+		else if (key == "tile_size") tileSize = parseInt(value, 1);
+		else if (key == "kernel") kernel = parseKernel(value);
+		else if (key == "page_cache_mb") pageCacheMb = parseInt(value, 0);
+		else if (key == "page_file") pageFile = value;
+		else if (key == "preprocess_geometry") preprocessGeometry = parseBool(value);
+		else if (key == "weld_tolerance") weldTolerance = parseFloat(value, 0.0f, FLT_MAX);
+		else if (key == "cost_images") costImages = parseBool(value);
+		else if (key == "quantize_vertices") quantizeVertices = parseBool(value);
+		else throw std::invalid_argument("unknown setting '" + key + "'");
+	}
+
+	/*
+	Read all settings from a config file, returns false if the file could not be opened
+	*/
+	bool loadFile(const std::string& filename) {
+		std::ifstream in(filename.c_str());
+		if (!in) return false;
+
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(in, line)) {
+			lineNumber++;
+			size_t comment = line.find('#');
+			if (comment != std::string::npos) line = line.substr(0, comment);
+			if (trim(line).empty()) continue;
+
+			size_t separator = line.find('=');
+			try {
+				if (separator == std::string::npos) throw std::invalid_argument("expected key = value");
+				set(trim(line.substr(0, separator)), trim(line.substr(separator + 1)));
+			}
+			catch (std::logic_error const& e) {
+				std::cout << filename << ":" << lineNumber << ": " << e.what() << ", line ignored" << std::endl;
+			}
+		}
+		return true;
+	}
+
+	/*
+	Apply --key=value arguments, --config=file loads a config file at that point
+	*/
+	void parseCommandLine(int argc, char* argv[]) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			size_t separator = arg.find('=');
+			try {
+				if (arg.substr(0, 2) != "--" || separator == std::string::npos) throw std::invalid_argument("expected --key=value");
+				std::string key = arg.substr(2, separator - 2);
+				std::string value = arg.substr(separator + 1);
+				// allow dashes on the command line, the config file uses underscores
+				for (char& c : key) if (c == '-') c = '_';
+				if (key == "config") {
+					if (!loadFile(value)) throw std::invalid_argument("cannot open config file '" + value + "'");
+				}
+				else set(key, value);
+			}
+			catch (std::logic_error const& e) {
+				std::cout << "Argument " << arg << ": " << e.what() << ", argument ignored" << std::endl;
+			}
+		}
+	}
+
+	void print() const {
+		std::cout << "Render settings:" << std::endl;
+		std::cout << "  model: " << model << std::endl;
+		if (!compileScene.empty()) std::cout << "  compile_scene: " << compileScene << std::endl;
+		std::cout << "  verify_scene: " << (verifyScene ? "on" : "off") << std::endl;
+		std::cout << "  max_recursive_depth: " << maxRecursiveDepth << std::endl;
+		std::cout << "  max_faces_per_box: " << maxFacesPerBox << std::endl;
+		std::cout << "  max_overlap: " << maxOverlap << std::endl;
+		std::cout << "  sampling_points_per_radius: " << samplingPointsPerRadius << std::endl;
+		std::cout << "  supersampling: " << (supersampling ? "on" : "off") << std::endl;
+		std::cout << "  multithreading: " << (multithreading ? "on" : "off") << std::endl;
+		std::cout << "  threads: " << threads << std::endl;
+		std::cout << "  pin_threads: " << (pinThreads ? "on" : "off") << std::endl;
+		std::cout << "  numa: " << (numa ? "on" : "off") << std::endl;
+		std::cout << "  tile_size: " << tileSize << std::endl;
+		std::cout << "  kernel: " << traceVariantName(kernel) << std::endl;
+		if (pageCacheMb > 0) std::cout << "  page_cache_mb: " << pageCacheMb << " (page_file: " << pageFile << ")" << std::endl;
+		std::cout << "  preprocess_geometry: " << (preprocessGeometry ? "on" : "off") << " (weld_tolerance: " << weldTolerance << ")" << std::endl;
+		std::cout << "  cost_images: " << (costImages ? "on" : "off") << std::endl;
+		std::cout << "  quantize_vertices: " << (quantizeVertices ? "on" : "off") << std::endl;
+	}
+
+private:
+	static std::string trim(const std::string& s) {
+		size_t start = s.find_first_not_of(" \t\r\n");
+		if (start == std::string::npos) return "";
+		size_t end = s.find_last_not_of(" \t\r\n");
+		return s.substr(start, end - start + 1);
+	}
+
+	static int parseInt(const std::string& value, int minimum) {
+		size_t used;
+		int result = std::stoi(value, &used);
+		if (used != value.size() || result < minimum) throw std::invalid_argument("invalid value '" + value + "'");
+		return result;
+	}
+
+	static float parseFloat(const std::string& value, float minimum, float maximum) {
+		size_t used;
+		float result = std::stof(value, &used);
+		if (used != value.size() || result < minimum || result > maximum) throw std::invalid_argument("invalid value '" + value + "'");
+		return result;
+	}
+
+	static bool parseBool(const std::string& value) {
+		if (value == "on" || value == "true" || value == "1") return true;
+		if (value == "off" || value == "false" || value == "0") return false;
+		throw std::invalid_argument("invalid value '" + value + "', use on or off");
+	}
+
+	static TraceVariant parseKernel(const std::string& value) {
+		for (int v = 0; v < (int)TraceVariant::Count; v++) {
+			std::string name = traceVariantName((TraceVariant)v);
+			for (char& c : name) if (c == ' ') c = '_';
+			if (value == name) return (TraceVariant)v;
+		}
+		throw std::invalid_argument("unknown kernel '" + value + "'");
+	}
+};
+
+#endif // RENDER_SETTINGS
@@ -0,0 +1,289 @@
+#ifndef __RT_SCENE__
+#define __RT_SCENE__
+
+#include <tucano/materials/mtl.hpp>
+#include <tucano/mesh.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "MappedFile.hpp"
+#include "SceneGeometry.hpp"
+
+/*
+Compiled scene (.rtscene): a loaded scene stored in the layout the tracer reads, so it can be mapped
+read-only and traced from without parsing anything (processes tracing the same file share its pages).
+After the header come the arrays, each starting at a multiple of 64 bytes:
+vertices (3 floats, world space), vertex normals (3 floats, only for the viewer), triangles (3 uint32),
+face normals (3 floats), face materials (uint16), materials, groups and optionally the boxes and their faces.
+Numbers are stored in the byte order of the machine that compiled the scene.
+*/
+class RtScene {
+public:
+	static const uint32_t version = 2;
+	static const size_t alignment = 64;
+
+	struct Header {
+		char magic[8];			// "RTSCENE"
+		uint32_t version;
+		uint32_t headerSize;	// sizeof(Header), catches files written with another layout
+		uint32_t vertexCount;
+		uint32_t faceCount;
+		uint32_t materialCount;
+		uint32_t groupCount;
+		uint32_t boxCount;		// 0 when the acceleration structure was not stored
+		uint32_t boxFaceCount;
+		uint64_t vertexOffset;
+		uint64_t vertexNormalOffset;
+		uint64_t triangleOffset;
+		uint64_t faceNormalOffset;
+		uint64_t faceMaterialOffset;
+		uint64_t materialOffset;
+		uint64_t groupOffset;
+		uint64_t boxOffset;
+		uint64_t boxFaceOffset;
+		uint64_t fileSize;
+	};
+
+	// Tucano::Material::Mtl without the strings
+	struct Material {
+		float ambient[3];
+		float diffuse[3];
+		float specular[3];
+		float shininess;
+		float opticalDensity;
+		float dissolveFactor;
+		int32_t illuminationModel;
+		char name[60];			// cut off and zero terminated
+	};
+
+	// Faces firstFace -> firstFace + faceCount drawn with one material in the viewer
+	struct Group {
+		int32_t material;
+		uint32_t firstFace;
+		uint32_t faceCount;
+	};
+
+private:
+	MappedFile file;
+	const Header* header = nullptr;
+
+	template <typename T>
+	const T* section(uint64_t offset) const { return reinterpret_cast<const T*>(file.data() + offset); }
+
+	// Check that an array of the header lies inside the file
+	bool validSection(uint64_t offset, uint64_t count, uint64_t elementSize) const {
+		return offset % alignment == 0 && offset <= file.size() && count * elementSize <= file.size() - offset;
+	}
+
+	/*
+	Check that every id in the arrays of a valid header points inside the array it indexes, one pass over each array
+	*/
+	bool validRanges(const Header* h) const {
+		const uint32_t* triangles = section<uint32_t>(h->triangleOffset);
+		for (uint64_t i = 0; i < 3 * (uint64_t)h->faceCount; i++)
+			if (triangles[i] >= h->vertexCount) return false;
+		const MaterialId* faceMaterials = section<MaterialId>(h->faceMaterialOffset);
+		for (uint32_t f = 0; f < h->faceCount; f++)
+			if (faceMaterials[f] >= h->materialCount) return false;
+		const Group* groups = section<Group>(h->groupOffset);
+		for (uint32_t i = 0; i < h->groupCount; i++)
+			if (groups[i].material < 0 || (uint32_t)groups[i].material >= h->materialCount
+				|| (uint64_t)groups[i].firstFace + groups[i].faceCount > h->faceCount) return false;
+		const GeometryBox* boxes = section<GeometryBox>(h->boxOffset);
+		for (uint32_t i = 0; i < h->boxCount; i++)
+			if ((uint64_t)boxes[i].firstFace + boxes[i].faceCount > h->boxFaceCount) return false;
+		const uint32_t* boxFaces = section<uint32_t>(h->boxFaceOffset);
+		for (uint32_t i = 0; i < h->boxFaceCount; i++)
+			if (boxFaces[i] >= h->faceCount) return false;
+		return true;
+	}
+
+	// Write an array at the next aligned offset, returns that offset
+	template <typename T>
+	static uint64_t writeSection(std::ofstream& out, const T* data, uint64_t count) {
+		static const char zeros[alignment] = {};
+		uint64_t offset = out.tellp();
+		uint64_t padding = (alignment - offset % alignment) % alignment;
+		out.write(zeros, padding);
+		if (count > 0) out.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+		return offset + padding;
+	}
+
+public:
+	RtScene() {}
+
+	// Compiled scenes are recognized by their extension
+	static bool isCompiled(const std::string& filename) {
+		std::string extension = ".rtscene";
+		return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+	}
+
+	/*
+	Map a compiled scene, returns false (after printing why) if it cannot be opened or is not valid:
+	the header has to match this version and its arrays have to lie inside the file. Only the header
+	is read, unless verify also checks that every id in the arrays is in range, so even a damaged file
+	cannot make the tracer read outside the mapping (the values themselves, positions and colors, are not checked)
+	*/
+	bool open(const std::string& filename, bool verify = false) {
+		header = nullptr;
+		if (!file.open(filename)) {
+			std::cerr << "Cannot open " << filename << std::endl;
+			return false;
+		}
+		const Header* h = section<Header>(0);
+		bool valid = file.size() >= sizeof(Header) && std::memcmp(h->magic, "RTSCENE", 8) == 0
+			&& h->version == version && h->headerSize == sizeof(Header) && h->fileSize == file.size()
+			&& validSection(h->vertexOffset, h->vertexCount, 3 * sizeof(float))
+			&& validSection(h->vertexNormalOffset, h->vertexCount, 3 * sizeof(float))
+			&& validSection(h->triangleOffset, h->faceCount, 3 * sizeof(uint32_t))
+			&& validSection(h->faceNormalOffset, h->faceCount, 3 * sizeof(float))
+			&& validSection(h->faceMaterialOffset, h->faceCount, sizeof(MaterialId))
+			&& validSection(h->materialOffset, h->materialCount, sizeof(Material))
+			&& validSection(h->groupOffset, h->groupCount, sizeof(Group))
+			&& validSection(h->boxOffset, h->boxCount, sizeof(GeometryBox))
+			&& validSection(h->boxFaceOffset, h->boxFaceCount, sizeof(uint32_t));
+		if (!valid) {
+			std::cerr << filename << " is not a compiled scene of version " << version << ", compile it again" << std::endl;
+			file.close();
+			return false;
+		}
+		if (verify && !validRanges(h)) {
+			std::cerr << filename << " is damaged: an id in its arrays is out of range, compile it again" << std::endl;
+			file.close();
+			return false;
+		}
+		header = h;
+		return true;
+	}
+
+	bool hasBoxes() const { return header->boxCount > 0; }
+
+	/*
+	The geometry in the mapped file, without boxes if none were stored
+	*/
+	SceneGeometry geometry() const {
+		SceneGeometry g;
+		g.vertices = section<float>(header->vertexOffset);
+		g.triangles = section<uint32_t>(header->triangleOffset);
+		g.faceNormals = section<float>(header->faceNormalOffset);
+		g.faceMaterials = section<MaterialId>(header->faceMaterialOffset);
+		g.vertexCount = header->vertexCount;
+		g.faceCount = header->faceCount;
+		if (hasBoxes()) {
+			g.boxes = section<GeometryBox>(header->boxOffset);
+			g.boxFaces = section<uint32_t>(header->boxFaceOffset);
+			g.boxCount = header->boxCount;
+			g.boxFaceCount = header->boxFaceCount;
+		}
+		return g;
+	}
+
+	/*
+	Append the materials of the scene
+	*/
+	void loadMaterials(std::vector<Tucano::Material::Mtl>& materials) const {
+		const Material* m = section<Material>(header->materialOffset);
+		for (uint32_t i = 0; i < header->materialCount; i++) {
+			Tucano::Material::Mtl mtl;
+			mtl.setAmbient(Eigen::Vector3f(m[i].ambient[0], m[i].ambient[1], m[i].ambient[2]));
+			mtl.setDiffuse(Eigen::Vector3f(m[i].diffuse[0], m[i].diffuse[1], m[i].diffuse[2]));
+			mtl.setSpecular(Eigen::Vector3f(m[i].specular[0], m[i].specular[1], m[i].specular[2]));
+			mtl.setShininess(m[i].shininess);
+			mtl.setOpticalDensity(m[i].opticalDensity);
+			mtl.setDissolveFactor(m[i].dissolveFactor);
+			mtl.setIlluminationModel(m[i].illuminationModel);
+			mtl.setName(m[i].name);
+			materials.push_back(mtl);
+		}
+	}
+
+	/*
+	Upload the scene to OpenGL for the viewer, it is already in world space so the model matrix stays the identity.
+	Must run on the thread owning the OpenGL context.
+	*/
+	void loadMesh(Tucano::Mesh& mesh) const {
+		const float* v = section<float>(header->vertexOffset);
+		const float* n = section<float>(header->vertexNormalOffset);
+		std::vector<Eigen::Vector4f> vertices(header->vertexCount);
+		std::vector<Eigen::Vector3f> normals(header->vertexCount);
+		for (uint32_t i = 0; i < header->vertexCount; i++) {
+			vertices[i] = Eigen::Vector4f(v[3 * i], v[3 * i + 1], v[3 * i + 2], 1.0f);
+			normals[i] = Eigen::Vector3f(n[3 * i], n[3 * i + 1], n[3 * i + 2]);
+		}
+		mesh.loadVertices(vertices);
+		mesh.loadNormals(normals);
+
+		const uint32_t* triangles = section<uint32_t>(header->triangleOffset);
+		const Group* groups = section<Group>(header->groupOffset);
+		for (uint32_t i = 0; i < header->groupCount; i++) {
+			std::vector<GLuint> indices(triangles + 3 * groups[i].firstFace, triangles + 3 * (groups[i].firstFace + groups[i].faceCount));
+			mesh.loadIndices(indices, groups[i].material);
+		}
+		mesh.setDefaultAttribLocations();
+	}
+
+	/*
+	Write a compiled scene, returns false if the file cannot be written
+	vertexNormals are only used by the viewer, missing ones are stored as zero
+	*/
+	static bool write(const std::string& filename, const SceneGeometry& geometry, const std::vector<Eigen::Vector3f>& vertexNormals,
+		std::vector<Tucano::Material::Mtl>& materials, const std::vector<Group>& groups, bool storeBoxes = true) {
+		std::ofstream out(filename.c_str(), std::ios::binary);
+		if (!out) return false;
+
+		Header h;
+		std::memset(&h, 0, sizeof(Header));
+		out.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+		std::memcpy(h.magic, "RTSCENE", 8);
+		h.version = version;
+		h.headerSize = sizeof(Header);
+		h.vertexCount = geometry.vertexCount;
+		h.faceCount = geometry.faceCount;
+		h.materialCount = materials.size();
+		h.groupCount = groups.size();
+		h.boxCount = storeBoxes ? geometry.boxCount : 0;
+		h.boxFaceCount = storeBoxes ? geometry.boxFaceCount : 0;
+
+		std::vector<float> normals(3 * geometry.vertexCount, 0.0f);
+		for (uint32_t i = 0; i < geometry.vertexCount && i < vertexNormals.size(); i++)
+			for (int k = 0; k < 3; k++) normals[3 * i + k] = vertexNormals[i][k];
+
+		std::vector<Material> flat(materials.size());
+		for (int i = 0; i < materials.size(); i++) {
+			Material& m = flat[i];
+			std::memset(&m, 0, sizeof(Material));
+			for (int k = 0; k < 3; k++) {
+				m.ambient[k] = materials[i].getAmbient()[k];
+				m.diffuse[k] = materials[i].getDiffuse()[k];
+				m.specular[k] = materials[i].getSpecular()[k];
+			}
+			m.shininess = materials[i].getShininess();
+			m.opticalDensity = materials[i].getOpticalDensity();
+			m.dissolveFactor = materials[i].getDissolveFactor();
+			m.illuminationModel = (int32_t)materials[i].getIlluminationModel();
+			std::string name = materials[i].getName();
+			std::memcpy(m.name, name.c_str(), std::min(name.size(), sizeof(m.name) - 1));
+		}
+
+		h.vertexOffset = writeSection(out, geometry.vertices, 3 * (uint64_t)geometry.vertexCount);
+		h.vertexNormalOffset = writeSection(out, normals.data(), normals.size());
+		h.triangleOffset = writeSection(out, geometry.triangles, 3 * (uint64_t)geometry.faceCount);
+		h.faceNormalOffset = writeSection(out, geometry.faceNormals, 3 * (uint64_t)geometry.faceCount);
+		h.faceMaterialOffset = writeSection(out, geometry.faceMaterials, geometry.faceCount);
+		h.materialOffset = writeSection(out, flat.data(), flat.size());
+		h.groupOffset = writeSection(out, groups.data(), groups.size());
+		h.boxOffset = writeSection(out, geometry.boxes, h.boxCount);
+		h.boxFaceOffset = writeSection(out, geometry.boxFaces, h.boxFaceCount);
+		h.fileSize = out.tellp();
+
+		out.seekp(0);
+		out.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+		return out.good();
+	}
+};
+
+#endif // RT_SCENE
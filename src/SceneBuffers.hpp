@@ -0,0 +1,464 @@
+#ifndef __SCENE_BUFFERS__
+#define __SCENE_BUFFERS__
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "box.hpp"
+#include "ObjLoader.hpp"
+#include "SceneGeometry.hpp"
+#include "ThreadPool.hpp"
+
+/*
+Arrays a SceneGeometry can point at, for scenes that were not loaded from a compiled file
+(and for the copies made per NUMA node)
+*/
+class SceneBuffers {
+public:
+	std::vector<float> vertices;
+	std::vector<uint32_t> triangles;
+	std::vector<float> faceNormals;
+	std::vector<MaterialId> faceMaterials;
+	std::vector<GeometryBox> boxes;
+	std::vector<uint32_t> boxFaces;
+	// compact mode, replacing vertices, faceNormals and triangles
+	std::vector<uint16_t> quantizedVertices;
+	std::vector<VertexCluster> clusters;
+	std::vector<int16_t> quantizedNormals;
+	std::vector<uint16_t> compactTriangles;
+	std::vector<FaceBlock> faceBlocks;
+	std::vector<FarCorner> farCorners;
+	// id in the loaded file of every vertex, set by preprocess (the viewer's vertex normals are stored by those ids)
+	std::vector<uint32_t> vertexSources;
+
+	// What preprocess removed
+	struct PreprocessStats {
+		uint32_t weldedVertices = 0;	// merged into another vertex or not used by any face
+		uint32_t degenerateFaces = 0;
+		uint32_t duplicateFaces = 0;
+	};
+
+	SceneBuffers() {}
+
+	// Copy of every array of the geometry
+	explicit SceneBuffers(const SceneGeometry& geometry)
+		: vertices(copyOf(geometry.vertices, 3 * geometry.vertexCount)),
+		triangles(copyOf(geometry.triangles, 3 * geometry.faceCount)),
+		faceNormals(copyOf(geometry.faceNormals, 3 * geometry.faceCount)),
+		faceMaterials(copyOf(geometry.faceMaterials, geometry.faceCount)),
+		boxes(copyOf(geometry.boxes, geometry.boxCount)),
+		boxFaces(copyOf(geometry.boxFaces, geometry.boxFaceCount)),
+		quantizedVertices(copyOf(geometry.quantizedVertices, 3 * geometry.vertexCount)),
+		clusters(copyOf(geometry.clusters, (geometry.vertexCount + SceneGeometry::clusterSize - 1) >> SceneGeometry::clusterBits)),
+		quantizedNormals(copyOf(geometry.quantizedNormals, 2 * geometry.faceCount)),
+		compactTriangles(copyOf(geometry.compactTriangles, 3 * geometry.faceCount)),
+		faceBlocks(copyOf(geometry.faceBlocks, (geometry.faceCount + SceneGeometry::faceBlockSize - 1) >> SceneGeometry::faceBlockBits)),
+		farCorners(copyOf(geometry.farCorners, geometry.farCornerCount)) {}
+
+	/*
+	Flatten the faces of a loaded file, group after group (empty groups have no faces) with the material
+	of the group. The vertices are moved to world space with shapeMatrix, the face normals are computed
+	from the file's vertices the same way Tucano::Mesh::createFaces does.
+	*/
+	void setTriangles(const ObjData& obj, const std::vector<int>& groupMaterials, const Eigen::Affine3f& shapeMatrix, ThreadPool* pool = nullptr) {
+		std::vector<uint32_t> firstFaces(obj.groups.size() + 1, 0);
+		for (int g = 0; g < obj.groups.size(); g++) firstFaces[g + 1] = firstFaces[g] + obj.groups[g].size() / 3;
+		int vertexCount = obj.vertices.size();
+		int faceCount = firstFaces.back();
+		vertices.resize(3 * vertexCount);
+		triangles.resize(3 * faceCount);
+		faceNormals.resize(3 * faceCount);
+		faceMaterials.resize(faceCount);
+
+		auto flattenVertex = [&](int i) {
+			Eigen::Vector3f v = (shapeMatrix * obj.vertices[i]).head<3>();
+			for (int k = 0; k < 3; k++) vertices[3 * i + k] = v[k];
+		};
+		auto flattenFace = [&](int f) {
+			// the group holding the face: the last one starting at or before it
+			int g = (int)(std::upper_bound(firstFaces.begin(), firstFaces.end(), (uint32_t)f) - firstFaces.begin()) - 1;
+			const GLuint* ids = obj.groups[g].data() + 3 * (f - firstFaces[g]);
+			Eigen::Vector3f v1 = (obj.vertices[ids[2]].head(3) - obj.vertices[ids[0]].head(3)).normalized();
+			Eigen::Vector3f v0 = (obj.vertices[ids[1]].head(3) - obj.vertices[ids[0]].head(3)).normalized();
+			Eigen::Vector3f normal = (v0.cross(v1)).normalized();
+			for (int k = 0; k < 3; k++) {
+				triangles[3 * f + k] = ids[k];
+				faceNormals[3 * f + k] = normal[k];
+			}
+			faceMaterials[f] = (MaterialId)groupMaterials[g];
+		};
+		if (pool != nullptr) {
+			pool->parallelFor(0, vertexCount, flattenVertex);
+			pool->parallelFor(0, faceCount, flattenFace);
+		}
+		else {
+			for (int i = 0; i < vertexCount; i++) flattenVertex(i);
+			for (int f = 0; f < faceCount; f++) flattenFace(f);
+		}
+	}
+
+	/*
+	Flatten the boxes of an acceleration structure, their faces are stored one box after the other
+	*/
+	void setBoxes(const std::vector<Box>& accelerationBoxes) {
+		boxes.clear();
+		boxFaces.clear();
+		for (const Box& b : accelerationBoxes) {
+			GeometryBox box;
+			for (int k = 0; k < 3; k++) {
+				box.min[k] = b.min[k];
+				box.max[k] = b.max[k];
+			}
+			box.firstFace = boxFaces.size();
+			box.faceCount = b.face_indexs.size();
+			boxFaces.insert(boxFaces.end(), b.face_indexs.begin(), b.face_indexs.end());
+			boxes.push_back(box);
+		}
+	}
+
+	/*
+	Clean up the triangles of a loaded file before the acceleration structure is built over them:
+	vertices closer than weldTolerance (0: at the same position) are welded into the first of them (the faces they
+	moved get new normals), faces without area and faces repeating an earlier one (in the same winding) are dropped,
+	then the faces are sorted along a Morton curve through their centers and the vertices are renumbered
+	in the order the faces use them.
+	The faces of a box then lie next to each other in memory, and so do their vertices.
+	*/
+	PreprocessStats preprocess(float weldTolerance, ThreadPool* pool = nullptr) {
+		PreprocessStats stats;
+		uint32_t vertexCount = vertices.size() / 3;
+		uint32_t faceCount = faceMaterials.size();
+		std::vector<uint32_t> welded = weld(weldTolerance);
+
+		// the first of every set of equal faces is kept, so a ray hitting all of them still sees the same one
+		std::vector<uint32_t> kept;
+		std::unordered_set<FaceKey, FaceKeyHash> seen;
+		kept.reserve(faceCount);
+		for (uint32_t f = 0; f < faceCount; f++) {
+			uint32_t a = welded[triangles[3 * f]], b = welded[triangles[3 * f + 1]], c = welded[triangles[3 * f + 2]];
+			Eigen::Vector3f u = positionOf(b) - positionOf(a);
+			Eigen::Vector3f v = positionOf(c) - positionOf(a);
+			if (a == b || b == c || a == c || !(u.cross(v).squaredNorm() > 0.0f)) {
+				stats.degenerateFaces++;
+				continue;
+			}
+			// the same face starting at its smallest id
+			FaceKey key = a < b && a < c ? FaceKey{ a, b, c } : (b < c ? FaceKey{ b, c, a } : FaceKey{ c, a, b });
+			if (!seen.insert(key).second) {
+				stats.duplicateFaces++;
+				continue;
+			}
+			kept.push_back(f);
+		}
+
+		// Morton codes of the face centers, 10 bits per axis within the bounds of all centers
+		std::vector<Eigen::Vector3f> centers(kept.size());
+		auto center = [&](int i) {
+			uint32_t f = kept[i];
+			centers[i] = (positionOf(welded[triangles[3 * f]]) + positionOf(welded[triangles[3 * f + 1]]) + positionOf(welded[triangles[3 * f + 2]])) / 3.0f;
+		};
+		Eigen::Vector3f min = Eigen::Vector3f::Constant(FLT_MAX), max = Eigen::Vector3f::Constant(-FLT_MAX);
+		if (pool != nullptr) pool->parallelFor(0, kept.size(), center);
+		else for (int i = 0; i < kept.size(); i++) center(i);
+		for (const Eigen::Vector3f& c : centers) {
+			min = min.cwiseMin(c);
+			max = max.cwiseMax(c);
+		}
+		Eigen::Vector3f extent = (max - min).cwiseMax(Eigen::Vector3f::Constant(FLT_MIN));
+		std::vector<std::pair<uint32_t, uint32_t>> order(kept.size());	// code, face
+		auto code = [&](int i) {
+			Eigen::Vector3f p = (centers[i] - min).cwiseQuotient(extent) * 1023.0f;
+			order[i] = std::make_pair(mortonCode((uint32_t)p.x(), (uint32_t)p.y(), (uint32_t)p.z()), kept[i]);
+		};
+		if (pool != nullptr) pool->parallelFor(0, kept.size(), code);
+		else for (int i = 0; i < kept.size(); i++) code(i);
+		std::sort(order.begin(), order.end());
+
+		// rebuild the arrays in the new order
+		std::vector<uint32_t> newIds(vertexCount, UINT32_MAX);
+		std::vector<float> sortedVertices;
+		std::vector<uint32_t> sortedTriangles(3 * order.size());
+		std::vector<float> sortedNormals(3 * order.size());
+		std::vector<MaterialId> sortedMaterials(order.size());
+		vertexSources.clear();
+		for (uint32_t i = 0; i < order.size(); i++) {
+			uint32_t f = order[i].second;
+			bool moved = false;
+			for (int k = 0; k < 3; k++) {
+				uint32_t source = welded[triangles[3 * f + k]];
+				if (newIds[source] == UINT32_MAX) {
+					newIds[source] = vertexSources.size();
+					vertexSources.push_back(source);
+					sortedVertices.insert(sortedVertices.end(), &vertices[3 * source], &vertices[3 * source] + 3);
+				}
+				sortedTriangles[3 * i + k] = newIds[source];
+				sortedNormals[3 * i + k] = faceNormals[3 * f + k];
+				moved = moved || positionOf(source) != positionOf(triangles[3 * f + k]);
+			}
+			// a face with a vertex welded into another position gets the normal of its new corners
+			if (moved) {
+				Eigen::Vector3f a = positionOf(welded[triangles[3 * f]]);
+				Eigen::Vector3f v1 = (positionOf(welded[triangles[3 * f + 2]]) - a).normalized();
+				Eigen::Vector3f v0 = (positionOf(welded[triangles[3 * f + 1]]) - a).normalized();
+				Eigen::Vector3f normal = (v0.cross(v1)).normalized();
+				for (int k = 0; k < 3; k++) sortedNormals[3 * i + k] = normal[k];
+			}
+			sortedMaterials[i] = faceMaterials[f];
+		}
+		stats.weldedVertices = vertexCount - vertexSources.size();
+		vertices.swap(sortedVertices);
+		triangles.swap(sortedTriangles);
+		faceNormals.swap(sortedNormals);
+		faceMaterials.swap(sortedMaterials);
+		return stats;
+	}
+
+	/*
+	Switch to the compact mode: every clusterSize consecutive vertices get their own bounds and are stored
+	as 16-bit steps within them, the face normals are encoded in two 16-bit numbers and the vertex ids of every
+	faceBlockSize consecutive faces are stored as 16-bit steps from the block's first vertex (after preprocess
+	the faces of a block use vertices that are close by in the array, the others go to farCorners).
+	Frees the float arrays and, unless they take less memory than the 16-bit ids, the 32-bit triangles.
+	*/
+	void quantize(ThreadPool* pool = nullptr) {
+		uint32_t vertexCount = vertices.size() / 3;
+		uint32_t faceCount = faceMaterials.size();
+		clusters.resize((vertexCount + SceneGeometry::clusterSize - 1) >> SceneGeometry::clusterBits);
+		quantizedVertices.resize(3 * vertexCount);
+		quantizedNormals.resize(2 * faceCount);
+
+		auto quantizeCluster = [&](int c) {
+			uint32_t first = (uint32_t)c << SceneGeometry::clusterBits;
+			uint32_t last = std::min(first + SceneGeometry::clusterSize, vertexCount);
+			VertexCluster& cluster = clusters[c];
+			for (int k = 0; k < 3; k++) {
+				float min = FLT_MAX, max = -FLT_MAX;
+				for (uint32_t i = first; i < last; i++) {
+					min = std::min(min, vertices[3 * i + k]);
+					max = std::max(max, vertices[3 * i + k]);
+				}
+				cluster.min[k] = min;
+				cluster.step[k] = (max - min) / 65535.0f;
+				for (uint32_t i = first; i < last; i++) {
+					long q = cluster.step[k] > 0.0f ? std::lround((vertices[3 * i + k] - min) / cluster.step[k]) : 0;
+					quantizedVertices[3 * i + k] = (uint16_t)std::max(0L, std::min(q, 65535L));
+				}
+			}
+		};
+		auto quantizeNormal = [&](int f) {
+			SceneGeometry::encodeNormal(Eigen::Vector3f(faceNormals[3 * f], faceNormals[3 * f + 1], faceNormals[3 * f + 2]), &quantizedNormals[2 * f]);
+		};
+
+		// the ids of a block are counted from the lowest one that leaves room for its highest one
+		faceBlocks.resize((faceCount + SceneGeometry::faceBlockSize - 1) >> SceneGeometry::faceBlockBits);
+		compactTriangles.resize(3 * faceCount);
+		std::vector<uint32_t> farCounts(faceBlocks.size(), 0);
+		auto cornersOf = [&](int b) {
+			uint32_t first = 3 * ((uint32_t)b << SceneGeometry::faceBlockBits);
+			return std::make_pair(first, std::min(first + 3 * SceneGeometry::faceBlockSize, 3 * faceCount));
+		};
+		auto near = [](uint32_t id, uint32_t firstVertex) { return id >= firstVertex && id - firstVertex < SceneGeometry::farVertex; };
+		auto placeBlock = [&](int b) {
+			std::pair<uint32_t, uint32_t> corners = cornersOf(b);
+			uint32_t max = 0;
+			for (uint32_t i = corners.first; i < corners.second; i++) max = std::max(max, triangles[i]);
+			uint32_t lowest = max - std::min(max, (uint32_t)SceneGeometry::farVertex - 1);
+			uint32_t firstVertex = max;
+			for (uint32_t i = corners.first; i < corners.second; i++)
+				if (triangles[i] >= lowest) firstVertex = std::min(firstVertex, triangles[i]);
+			faceBlocks[b].firstVertex = firstVertex;
+			for (uint32_t i = corners.first; i < corners.second; i++)
+				if (!near(triangles[i], firstVertex)) farCounts[b]++;
+		};
+		auto compactBlock = [&](int b) {
+			std::pair<uint32_t, uint32_t> corners = cornersOf(b);
+			FarCorner* far = farCorners.data() + faceBlocks[b].firstFar;
+			for (uint32_t i = corners.first; i < corners.second; i++) {
+				if (near(triangles[i], faceBlocks[b].firstVertex)) {
+					compactTriangles[i] = (uint16_t)(triangles[i] - faceBlocks[b].firstVertex);
+					continue;
+				}
+				compactTriangles[i] = SceneGeometry::farVertex;
+				*far++ = FarCorner{ i, triangles[i] };
+			}
+		};
+		if (pool != nullptr) {
+			pool->parallelFor(0, clusters.size(), quantizeCluster);
+			pool->parallelFor(0, faceCount, quantizeNormal);
+			pool->parallelFor(0, faceBlocks.size(), placeBlock);
+		}
+		else {
+			for (int c = 0; c < clusters.size(); c++) quantizeCluster(c);
+			for (int f = 0; f < faceCount; f++) quantizeNormal(f);
+			for (int b = 0; b < faceBlocks.size(); b++) placeBlock(b);
+		}
+		uint32_t farCount = 0;
+		for (int b = 0; b < faceBlocks.size(); b++) {
+			faceBlocks[b].firstFar = farCount;
+			farCount += farCounts[b];
+		}
+		std::vector<float>().swap(vertices);
+		std::vector<float>().swap(faceNormals);
+
+		// faces using vertices all over the array (not preprocessed) keep the 32-bit ids when they are smaller
+		if (compactTriangles.size() * sizeof(uint16_t) + faceBlocks.size() * sizeof(FaceBlock) + farCount * sizeof(FarCorner) >= triangles.size() * sizeof(uint32_t)) {
+			std::vector<uint16_t>().swap(compactTriangles);
+			std::vector<FaceBlock>().swap(faceBlocks);
+			return;
+		}
+		farCorners.resize(farCount);
+		if (pool != nullptr) pool->parallelFor(0, faceBlocks.size(), compactBlock);
+		else for (int b = 0; b < faceBlocks.size(); b++) compactBlock(b);
+		std::vector<uint32_t>().swap(triangles);
+	}
+
+	bool quantized() const { return !quantizedVertices.empty() || !quantizedNormals.empty(); }
+
+	// Memory of the vertex positions and face normals, in whichever form they are stored
+	size_t positionAndNormalBytes() const {
+		return vertices.size() * sizeof(float) + faceNormals.size() * sizeof(float) + quantizedVertices.size() * sizeof(uint16_t)
+			+ clusters.size() * sizeof(VertexCluster) + quantizedNormals.size() * sizeof(int16_t);
+	}
+
+	// Memory of the vertex ids of the faces, in whichever form they are stored
+	size_t triangleBytes() const {
+		return triangles.size() * sizeof(uint32_t) + compactTriangles.size() * sizeof(uint16_t) + faceBlocks.size() * sizeof(FaceBlock)
+			+ farCorners.size() * sizeof(FarCorner);
+	}
+
+	// Memory of all arrays
+	size_t bytes() const {
+		return positionAndNormalBytes() + triangleBytes() + faceMaterials.size() * sizeof(MaterialId)
+			+ boxes.size() * sizeof(GeometryBox) + boxFaces.size() * sizeof(uint32_t);
+	}
+
+	// The triangles and boxes stored here
+	SceneGeometry view() const {
+		SceneGeometry geometry;
+		geometry.vertices = dataOf(vertices);
+		geometry.triangles = dataOf(triangles);
+		geometry.faceNormals = dataOf(faceNormals);
+		geometry.faceMaterials = dataOf(faceMaterials);
+		geometry.quantizedVertices = dataOf(quantizedVertices);
+		geometry.clusters = dataOf(clusters);
+		geometry.quantizedNormals = dataOf(quantizedNormals);
+		geometry.compactTriangles = dataOf(compactTriangles);
+		geometry.faceBlocks = dataOf(faceBlocks);
+		geometry.farCorners = dataOf(farCorners);
+		geometry.farCornerCount = farCorners.size();
+		geometry.vertexCount = (vertices.size() + quantizedVertices.size()) / 3;
+		geometry.faceCount = faceMaterials.size();
+		attachBoxes(geometry);
+		return geometry;
+	}
+
+	// Point the geometry at the boxes stored here, keeping its triangles
+	void attachBoxes(SceneGeometry& geometry) const {
+		geometry.boxes = boxes.data();
+		geometry.boxFaces = boxFaces.data();
+		geometry.boxCount = boxes.size();
+		geometry.boxFaceCount = boxFaces.size();
+	}
+
+private:
+	struct FaceKey {
+		uint32_t a, b, c;
+		bool operator==(const FaceKey& o) const { return a == o.a && b == o.b && c == o.c; }
+	};
+	struct FaceKeyHash {
+		size_t operator()(const FaceKey& k) const { return ((size_t)k.a * 73856093u) ^ ((size_t)k.b * 19349663u) ^ ((size_t)k.c * 83492791u); }
+	};
+	// Cell of the welding grid: the cell coordinates, or with a tolerance of 0 the bits of the position
+	struct CellKey {
+		int64_t x, y, z;
+		bool operator==(const CellKey& o) const { return x == o.x && y == o.y && z == o.z; }
+	};
+	struct CellKeyHash {
+		size_t operator()(const CellKey& k) const { return ((size_t)k.x * 73856093u) ^ ((size_t)k.y * 19349663u) ^ ((size_t)k.z * 83492791u); }
+	};
+
+	Eigen::Vector3f positionOf(uint32_t id) const { return Eigen::Vector3f(vertices[3 * id], vertices[3 * id + 1], vertices[3 * id + 2]); }
+
+	/*
+	The vertex every vertex is welded into: itself, or the first vertex within tolerance of it.
+	The vertices are put in a grid with cells as large as the tolerance, so only the neighbouring cells are searched.
+	The cells are counted from the lower corner of the bounds and are made larger when the bounds would need more than
+	maximumCells of them along an axis, so the cell coordinates always fit.
+	*/
+	std::vector<uint32_t> weld(float tolerance) const {
+		static const double maximumCells = 1 << 30;
+		uint32_t vertexCount = vertices.size() / 3;
+		std::vector<uint32_t> welded(vertexCount);
+		std::unordered_map<CellKey, std::vector<uint32_t>, CellKeyHash> grid;
+		grid.reserve(vertexCount);
+		Eigen::Vector3f min = Eigen::Vector3f::Constant(FLT_MAX), max = Eigen::Vector3f::Constant(-FLT_MAX);
+		for (uint32_t i = 0; i < vertexCount; i++) {
+			min = min.cwiseMin(positionOf(i));
+			max = max.cwiseMax(positionOf(i));
+		}
+		double cellSize = std::max((double)tolerance, (double)(max - min).maxCoeff() / maximumCells);
+		// also 0 for positions that are not finite
+		auto cellOf = [&](float value, int axis) {
+			double c = std::floor((value - (double)min[axis]) / cellSize);
+			return (int64_t)(c >= 0.0 ? std::min(c, maximumCells) : 0.0);
+		};
+		for (uint32_t i = 0; i < vertexCount; i++) {
+			Eigen::Vector3f p = positionOf(i);
+			welded[i] = i;
+			if (tolerance <= 0.0f) {
+				CellKey key = { bitsOf(p.x()), bitsOf(p.y()), bitsOf(p.z()) };
+				std::vector<uint32_t>& cell = grid[key];
+				if (!cell.empty()) welded[i] = cell[0];
+				else cell.push_back(i);
+				continue;
+			}
+			CellKey key = { cellOf(p.x(), 0), cellOf(p.y(), 1), cellOf(p.z(), 2) };
+			uint32_t nearest = UINT32_MAX;
+			for (int dx = -1; dx <= 1; dx++) for (int dy = -1; dy <= 1; dy++) for (int dz = -1; dz <= 1; dz++) {
+				auto neighbour = grid.find(CellKey{ key.x + dx, key.y + dy, key.z + dz });
+				if (neighbour == grid.end()) continue;
+				for (uint32_t other : neighbour->second)
+					if (other < nearest && (positionOf(other) - p).squaredNorm() <= tolerance * tolerance) nearest = other;
+			}
+			if (nearest != UINT32_MAX) welded[i] = nearest;
+			else grid[key].push_back(i);
+		}
+		return welded;
+	}
+
+	// Bits of a float, with -0 and 0 the same
+	static int64_t bitsOf(float value) {
+		value += 0.0f;
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	// Interleave the low 10 bits of x, y and z
+	static uint32_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+		auto spread = [](uint32_t v) {
+			v = std::min(v, 1023u);
+			v = (v | (v << 16)) & 0x030000FF;
+			v = (v | (v << 8)) & 0x0300F00F;
+			v = (v | (v << 4)) & 0x030C30C3;
+			v = (v | (v << 2)) & 0x09249249;
+			return v;
+		};
+		return (spread(x) << 2) | (spread(y) << 1) | spread(z);
+	}
+
+	template <typename T>
+	static std::vector<T> copyOf(const T* data, size_t count) { return data != nullptr ? std::vector<T>(data, data + count) : std::vector<T>(); }
+
+	// Arrays that are not used are null in the geometry
+	template <typename T>
+	static const T* dataOf(const std::vector<T>& v) { return v.empty() ? nullptr : v.data(); }
+};
+
+#endif // SCENE_BUFFERS
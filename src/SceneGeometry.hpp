@@ -0,0 +1,232 @@
+#ifndef __SCENE_GEOMETRY__
+#define __SCENE_GEOMETRY__
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "GeometryPages.hpp"
+#include "ScratchArena.hpp"
+
+// Index of a material in the MaterialTable, 16 bits per face
+typedef uint16_t MaterialId;
+
+/*
+Bounds of SceneGeometry::clusterSize consecutive vertices in the compact mode,
+their positions are stored as 16-bit steps from min
+*/
+struct VertexCluster {
+	float min[3];
+	float step[3];
+};
+
+/*
+SceneGeometry::faceBlockSize consecutive faces in the compact mode: their vertex ids are stored as
+16-bit steps from firstVertex, the ids out of that range are in SceneGeometry::farCorners from firstFar on
+*/
+struct FaceBlock {
+	uint32_t firstVertex;
+	uint32_t firstFar;
+};
+
+// A corner (3 * face + corner) of the compact mode whose vertex id does not fit in the 16 bits of its block
+struct FarCorner {
+	uint32_t corner;
+	uint32_t vertex;
+};
+
+/*
+Leaf of the acceleration structure: its bounds and the range of SceneGeometry::boxFaces inside it
+*/
+struct GeometryBox {
+	float min[3];
+	float max[3];
+	uint32_t firstFace;
+	uint32_t faceCount;
+};
+
+/*
+The triangles the tracer works on, as flat arrays in world space.
+It only points at the arrays, they are owned by SceneBuffers or live in a mapped .rtscene file.
+This is the one copy of the scene, the acceleration structure and the tracer both read it.
+Out of core the faces are read from GeometryPages instead, the boxes then have no face lists:
+the faces of a box are the ids firstFace -> firstFace + faceCount of the page file.
+In the compact mode (see SceneBuffers::quantize) there are no float vertices, face normals and 32-bit
+triangles, they are decoded from 16-bit positions, octahedral normals and 16-bit vertex ids when they are read.
+*/
+struct SceneGeometry {
+	static const int clusterBits = 8;
+	static const uint32_t clusterSize = 1 << clusterBits;
+	static const int faceBlockBits = 8;
+	static const uint32_t faceBlockSize = 1 << faceBlockBits;
+	static const uint16_t farVertex = 0xFFFF;	// compact vertex id of a corner in farCorners
+
+	const float* vertices = nullptr;		// x, y, z per vertex, in world space
+	const uint32_t* triangles = nullptr;	// 3 vertex ids per face
+	const float* faceNormals = nullptr;		// x, y, z per face
+	const MaterialId* faceMaterials = nullptr;
+	const GeometryBox* boxes = nullptr;
+	const uint32_t* boxFaces = nullptr;		// the faces of every box, one range after the other
+	GeometryPages* pages = nullptr;			// set out of core, the arrays above except the boxes are not used
+	const uint16_t* quantizedVertices = nullptr;	// compact mode: x, y, z steps per vertex
+	const VertexCluster* clusters = nullptr;		// compact mode: bounds of every clusterSize vertices
+	const int16_t* quantizedNormals = nullptr;		// compact mode: octahedral x, y per face
+	const uint16_t* compactTriangles = nullptr;		// compact mode: 3 vertex ids per face, within the block of the face
+	const FaceBlock* faceBlocks = nullptr;			// compact mode: every faceBlockSize faces
+	const FarCorner* farCorners = nullptr;			// compact mode: by corner
+	uint32_t vertexCount = 0;
+	uint32_t faceCount = 0;
+	uint32_t boxCount = 0;
+	uint32_t boxFaceCount = 0;
+	uint32_t farCornerCount = 0;
+
+	// A vertex by its id (not out of core)
+	Eigen::Vector3f position(uint32_t id) const {
+		if (quantizedVertices != nullptr) {
+			const VertexCluster& c = clusters[id >> clusterBits];
+			const uint16_t* q = quantizedVertices + 3 * id;
+			return Eigen::Vector3f(c.min[0] + q[0] * c.step[0], c.min[1] + q[1] * c.step[1], c.min[2] + q[2] * c.step[2]);
+		}
+		const float* v = vertices + 3 * id;
+		return Eigen::Vector3f(v[0], v[1], v[2]);
+	}
+
+	// Id of the vertex at a corner (0, 1 or 2) of a face (not out of core)
+	uint32_t vertexId(int face, int corner) const {
+		if (compactTriangles == nullptr) return triangles[3 * face + corner];
+		uint32_t i = 3 * face + corner;
+		uint32_t b = face >> faceBlockBits;
+		if (compactTriangles[i] != farVertex) return faceBlocks[b].firstVertex + compactTriangles[i];
+		// the far corners of the block, sorted by corner
+		const FarCorner* first = farCorners + faceBlocks[b].firstFar;
+		const FarCorner* last = farCorners + ((b + 1) << faceBlockBits < faceCount ? faceBlocks[b + 1].firstFar : farCornerCount);
+		const FarCorner* far = std::lower_bound(first, last, i, [](const FarCorner& f, uint32_t c) { return f.corner < c; });
+		assert(far != last && far->corner == i);
+		return far->vertex;
+	}
+
+	// Corner (0, 1 or 2) of a face
+	Eigen::Vector3f vertex(int face, int corner) const {
+		if (pages != nullptr) {
+			const float* v = pages->face(face).vertices + 3 * corner;
+			return Eigen::Vector3f(v[0], v[1], v[2]);
+		}
+		return position(vertexId(face, corner));
+	}
+
+	Eigen::Vector3f normal(int face) const {
+		if (quantizedNormals != nullptr) return decodeNormal(quantizedNormals + 2 * face);
+		const float* n = pages != nullptr ? pages->face(face).normal : faceNormals + 3 * face;
+		return Eigen::Vector3f(n[0], n[1], n[2]);
+	}
+
+	/*
+	Octahedral encoding of a unit vector in two 16-bit numbers: the vector is projected on the octahedron
+	|x| + |y| + |z| = 1 and the lower half is folded over the upper one. A zero vector is stored as +z.
+	*/
+	static void encodeNormal(const Eigen::Vector3f& n, int16_t* q) {
+		float sum = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+		if (!(sum > 0.0f)) {
+			q[0] = q[1] = 0;
+			return;
+		}
+		float x = n.x() / sum;
+		float y = n.y() / sum;
+		if (n.z() < 0.0f) {
+			float foldedX = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+			float foldedY = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+			x = foldedX;
+			y = foldedY;
+		}
+		q[0] = (int16_t)std::lround(x * 32767.0f);
+		q[1] = (int16_t)std::lround(y * 32767.0f);
+	}
+
+	static Eigen::Vector3f decodeNormal(const int16_t* q) {
+		float x = q[0] / 32767.0f;
+		float y = q[1] / 32767.0f;
+		float z = 1.0f - std::abs(x) - std::abs(y);
+		if (z < 0.0f) {
+			float unfoldedX = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+			float unfoldedY = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+			x = unfoldedX;
+			y = unfoldedY;
+		}
+		return Eigen::Vector3f(x, y, z).normalized();
+	}
+
+	MaterialId material(int face) const { return pages != nullptr ? pages->face(face).material : faceMaterials[face]; }
+
+	/*
+	Collect the faces of all boxes hit by the ray into faces (which lives in the scratch arena of the caller),
+	returns the number of boxes hit
+	*/
+	uint32_t intersectBoxes(const Eigen::Vector3f& rayDirection, const Eigen::Vector3f& origin, ScratchVector<int>& faces) const {
+		uint32_t hits = 0;
+		for (uint32_t i = 0; i < boxCount; i++) {
+			const GeometryBox& b = boxes[i];
+			if (!intersectBox(b, rayDirection, origin)) continue;
+			hits++;
+			if (boxFaces != nullptr) faces.insert(faces.end(), boxFaces + b.firstFace, boxFaces + b.firstFace + b.faceCount);
+			else for (uint32_t f = b.firstFace; f < b.firstFace + b.faceCount; f++) faces.push_back(f);
+		}
+		return hits;
+	}
+
+	/*
+	Write the faces to a page file box after box, pagedBoxes gets the boxes with their ranges of face ids in that file.
+	Returns false if the file cannot be written.
+	*/
+	bool writePages(const std::string& filename, std::vector<GeometryBox>& pagedBoxes) const {
+		GeometryPages::Writer writer;
+		if (!writer.open(filename)) return false;
+		pagedBoxes.assign(boxes, boxes + boxCount);
+		for (GeometryBox& box : pagedBoxes) {
+			uint32_t first = box.firstFace;
+			for (uint32_t i = 0; i < box.faceCount; i++) {
+				uint32_t face = boxFaces[first + i];
+				GeometryPages::Face paged;
+				for (int corner = 0; corner < 3; corner++) {
+					Eigen::Vector3f v = vertex(face, corner);
+					for (int k = 0; k < 3; k++) paged.vertices[3 * corner + k] = v[k];
+				}
+				Eigen::Vector3f n = normal(face);
+				for (int k = 0; k < 3; k++) paged.normal[k] = n[k];
+				paged.material = faceMaterials[face];
+				paged.unused = 0;
+				uint32_t id = writer.add(paged);
+				if (i == 0) box.firstFace = id;
+			}
+		}
+		return writer.close();
+	}
+
+	// Ray-box intersection, the same test as Box::intersect
+	static bool intersectBox(const GeometryBox& box, const Eigen::Vector3f& rayDirection, const Eigen::Vector3f& origin) {
+		float tXmin = (box.min[0] - origin.x()) / rayDirection.x();
+		float tXmax = (box.max[0] - origin.x()) / rayDirection.x();
+		if (tXmin > tXmax) std::swap(tXmin, tXmax);
+
+		float tYmin = (box.min[1] - origin.y()) / rayDirection.y();
+		float tYmax = (box.max[1] - origin.y()) / rayDirection.y();
+		if (tYmin > tYmax) std::swap(tYmin, tYmax);
+
+		if ((tXmin > tYmax) || (tYmin > tXmax))
+			return false;
+		if (tYmin > tXmin)
+			tXmin = tYmin;
+		if (tYmax < tXmax)
+			tXmax = tYmax;
+
+		float tZmin = (box.min[2] - origin.z()) / rayDirection.z();
+		float tZmax = (box.max[2] - origin.z()) / rayDirection.z();
+		if (tZmin > tZmax) std::swap(tZmin, tZmax);
+
+		return !((tXmin > tZmax) || (tZmin > tXmax));
+	}
+};
+
+#endif // SCENE_GEOMETRY
@@ -0,0 +1,111 @@
+#ifndef __SCRATCH_ARENA__
+#define __SCRATCH_ARENA__
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <new>
+
+/*
+Bump allocator for short-lived data of the ray tracing hot path (candidate face lists etc).
+Memory is taken from a list of blocks that are kept alive between resets, so once the
+blocks have grown to the size a pixel needs, tracing a pixel does not touch the heap anymore.
+Every render thread owns its own arena (see ScratchArena::local()), and resets it after each pixel.
+*/
+class ScratchArena {
+private:
+	struct Block {
+		char* data;
+		size_t size;
+	};
+
+	std::vector<Block> blocks;
+	// block we are currently allocating from and the first free byte in it
+	size_t current = 0;
+	size_t offset = 0;
+	// number of blocks requested from the heap by this arena
+	unsigned long long blockAllocations = 0;
+
+	void addBlock(size_t minimumSize) {
+		size_t size = minimumSize > BLOCK_SIZE ? minimumSize : BLOCK_SIZE;
+		char* data = static_cast<char*>(std::malloc(size));
+		if (data == nullptr) throw std::bad_alloc();
+		blocks.push_back({ data, size });
+		blockAllocations++;
+	}
+
+public:
+	static const size_t BLOCK_SIZE = 64 * 1024;
+
+	ScratchArena() {}
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	~ScratchArena() {
+		for (Block& b : blocks) std::free(b.data);
+	}
+
+	/*
+	The arena of the calling thread
+	*/
+	static ScratchArena& local() {
+		thread_local ScratchArena arena;
+		return arena;
+	}
+
+	void* allocate(size_t bytes, size_t alignment) {
+		while (current < blocks.size()) {
+			size_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+			if (aligned + bytes <= blocks[current].size) {
+				offset = aligned + bytes;
+				return blocks[current].data + aligned;
+			}
+			// this block is full, continue in the next one
+			current++;
+			offset = 0;
+		}
+		addBlock(bytes + alignment);
+		current = blocks.size() - 1;
+		offset = 0;
+		return allocate(bytes, alignment);
+	}
+
+	/*
+	Release everything allocated since the last reset, the blocks themselves are kept
+	*/
+	void reset() {
+		current = 0;
+		offset = 0;
+	}
+
+	unsigned long long getBlockAllocations() const { return blockAllocations; }
+};
+
+/*
+STL allocator on top of the arena of the calling thread, deallocation is a no-op
+*/
+template <typename T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+
+	ScratchArena* arena;
+
+	ArenaAllocator() : arena(&ScratchArena::local()) {}
+	ArenaAllocator(ScratchArena& _arena) : arena(&_arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif // SCRATCH_ARENA
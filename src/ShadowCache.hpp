@@ -0,0 +1,112 @@
+#ifndef __SHADOW_CACHE__
+#define __SHADOW_CACHE__
+
+#include <atomic>
+#include <vector>
+#include <iostream>
+
+/*
+Remembers, per light and per sampling point, the last triangle that blocked the shadow ray.
+Neighbouring pixels usually share the same occluder towards a given light sample, so testing
+that single triangle first lets most shadowed points skip the acceleration structure entirely.
+Every render thread owns its own cache (see ShadowCache::local()), so lookups need no locking.
+*/
+class ShadowCache {
+private:
+	// lastOccluder[light][sample] holds a face index, -1 means nothing cached yet
+	std::vector<std::vector<int>> lastOccluder;
+
+	// Counters of this thread, added to the global totals on flush()
+	unsigned long long hits = 0;
+	unsigned long long lookups = 0;
+
+	// value of generation() when this cache was last cleared
+	unsigned int validGeneration = 0;
+
+	// bumped by invalidateAll(), every cache clears itself on its next lookup
+	static std::atomic<unsigned int>& generation() {
+		static std::atomic<unsigned int> counter(0);
+		return counter;
+	}
+
+	static std::atomic<unsigned long long>& totalHits() {
+		static std::atomic<unsigned long long> counter(0);
+		return counter;
+	}
+
+	static std::atomic<unsigned long long>& totalLookups() {
+		static std::atomic<unsigned long long> counter(0);
+		return counter;
+	}
+
+public:
+	ShadowCache() {}
+
+	~ShadowCache() { flush(); }
+
+	/*
+	The cache of the calling thread
+	*/
+	static ShadowCache& local() {
+		thread_local ShadowCache cache;
+		return cache;
+	}
+
+	/*
+	Face index that last occluded sample j of light i, or -1
+	*/
+	int lookup(int light, int sample) {
+		lookups++;
+		unsigned int current = generation().load(std::memory_order_relaxed);
+		if (current != validGeneration) {
+			clear();
+			validGeneration = current;
+		}
+		if (light >= lastOccluder.size() || sample >= lastOccluder[light].size()) return -1;
+		return lastOccluder[light][sample];
+	}
+
+	void recordHit() { hits++; }
+
+	void store(int light, int sample, int face) {
+		if (light >= lastOccluder.size()) lastOccluder.resize(light + 1);
+		if (sample >= lastOccluder[light].size()) lastOccluder[light].resize(sample + 1, -1);
+		lastOccluder[light][sample] = face;
+	}
+
+	/*
+	Forget all cached occluders, needed when the lights or the geometry change
+	*/
+	void clear() { lastOccluder.clear(); }
+
+	/*
+	Clear the caches of all threads (the worker threads keep theirs between renders)
+	*/
+	static void invalidateAll() { generation()++; }
+
+	/*
+	Add the counters of this thread to the global totals
+	*/
+	void flush() {
+		totalHits() += hits;
+		totalLookups() += lookups;
+		hits = 0;
+		lookups = 0;
+	}
+
+	static void resetStatistics() {
+		totalHits() = 0;
+		totalLookups() = 0;
+	}
+
+	static unsigned long long getHits() { return totalHits(); }
+	static unsigned long long getLookups() { return totalLookups(); }
+
+	static void printStatistics() {
+		unsigned long long l = getLookups();
+		float rate = l > 0 ? (100.0f * getHits()) / l : 0.0f;
+		std::cout << "Shadow cache: " << getHits() << " hits / " << l << " lookups (" << rate << "% hit rate)" << std::endl;
+	}
+};
+
+#endif // SHADOW_CACHE
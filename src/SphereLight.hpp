@@ -7,8 +7,6 @@
 #include <tucano/shapes/sphere.hpp>
 #include <tucano/shapes/box.hpp>
 
-// Let the number of sampling points depend on the radius (larger sphere light -> more samples)
-#define SAMPLING_POINTS_PER_RADIUS 80
 // A sphere light won't be displayed transparant (alpha = 1) 
 #define SPHERE_ALPHA 1.f
 
@@ -22,20 +20,24 @@ private:
 public:
 	SphereLight() {}
 
-	SphereLight(Eigen::Vector3f _position, Eigen::Vector3f _color, float _radius)
+	/*
+	The number of sampling points depends on the radius (larger sphere light -> more samples),
+	samplingPointsPerRadius comes from the RenderSettings
+	*/
+	SphereLight(Eigen::Vector3f _position, Eigen::Vector3f _color, float _radius, float samplingPointsPerRadius)
 	{
 		position = _position;
 		radius = _radius;
 		color = _color;
 		s = Tucano::Shapes::Sphere(radius, 4);
 		s.setColor(Eigen::Vector4f(color.x(), color.y(), color.z(), SPHERE_ALPHA));
-		samplingPoints = this->generateSamplingPoints(max(radius * SAMPLING_POINTS_PER_RADIUS, 1.f));
+		samplingPoints = this->generateSamplingPoints(max(radius * samplingPointsPerRadius, 1.f));
 	}
 
-	Eigen::Vector3f getLightPosition() { return position; }
-	Eigen::Vector3f getLightColor() { return color; }
+	Eigen::Vector3f getLightPosition() const { return position; }
+	Eigen::Vector3f getLightColor() const { return color; }
 	Tucano::Shapes::Sphere getShape() { return s; }
-	vector<Eigen::Vector3f> getSamplingPoints() { return samplingPoints; }
+	const vector<Eigen::Vector3f>& getSamplingPoints() const { return samplingPoints; }
 
 	/*
 	Allows the change the attributes of the sphere that is represting this light in the 3D scene
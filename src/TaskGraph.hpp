@@ -0,0 +1,130 @@
+#ifndef __TASK_GRAPH__
+#define __TASK_GRAPH__
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ThreadPool.hpp"
+
+/*
+A set of named tasks with dependencies between them, used to run the startup steps in parallel.
+Every task runs either on a ThreadPool or on the thread calling run() (for OpenGL work, which
+has to stay on the thread owning the context). A task only depends on tasks added before it,
+so running them in the order they were added can never deadlock. A pool task is only submitted
+once its dependencies have finished, so it never blocks a worker that other tasks need.
+Tasks on a pool may still be running when run() returns, wait() blocks until one has finished.
+*/
+class TaskGraph {
+private:
+	struct Task {
+		std::string name;
+		ThreadPool* executor;			// nullptr runs on the thread calling run()
+		std::function<void()> work;
+		std::vector<int> dependencies;
+		std::vector<int> dependents;
+		std::promise<void> finished;
+		std::shared_future<void> done;
+	};
+
+	std::vector<Task> tasks;
+	// dependencies of every task that have not finished yet
+	std::unique_ptr<std::atomic<int>[]> pending;
+	std::chrono::steady_clock::time_point start;
+	bool verbose;
+
+	float secondsSinceStart() const {
+		return std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/*
+	Run a task once its dependencies are done, a failed dependency fails the task as well
+	*/
+	void execute(int index) {
+		Task& task = tasks[index];
+		try {
+			for (int d : task.dependencies)
+				tasks[d].done.get();
+			float begin = secondsSinceStart();
+			task.work();
+			if (verbose) {
+				// one string per line, tasks finish on different threads
+				std::ostringstream line;
+				line << "Startup: " << task.name << " " << begin << " -> " << secondsSinceStart() << " s" << std::endl;
+				std::cout << line.str();
+			}
+			task.finished.set_value();
+		}
+		catch (...) {
+			task.finished.set_exception(std::current_exception());
+		}
+		// drop what the work captured (e.g. the parsed file) as soon as the last task using it is done
+		task.work = nullptr;
+
+		// start the pool tasks that were only waiting for this one
+		for (int d : task.dependents) {
+			if (--pending[d] == 0 && tasks[d].executor != nullptr)
+				submit(d);
+		}
+	}
+
+	void submit(int index) {
+		tasks[index].executor->submit([this, index] { execute(index); });
+	}
+
+public:
+	TaskGraph(bool _verbose = true) : start(std::chrono::steady_clock::now()), verbose(_verbose) {}
+
+	/*
+	Add a task, returns its id that later tasks can depend on
+	*/
+	int add(const std::string& name, ThreadPool* executor, std::function<void()> work, std::vector<int> dependencies = std::vector<int>()) {
+		tasks.push_back(Task());
+		Task& task = tasks.back();
+		task.name = name;
+		task.executor = executor;
+		task.work = work;
+		task.dependencies = dependencies;
+		return tasks.size() - 1;
+	}
+
+	/*
+	Start the pool tasks and run the other ones on this thread, in the order they were added
+	*/
+	void run() {
+		start = std::chrono::steady_clock::now();
+		pending.reset(new std::atomic<int>[tasks.size()]);
+		for (int i = 0; i < tasks.size(); i++) {
+			tasks[i].done = tasks[i].finished.get_future().share();
+			pending[i] = tasks[i].dependencies.size();
+			for (int d : tasks[i].dependencies)
+				tasks[d].dependents.push_back(i);
+		}
+		for (int i = 0; i < tasks.size(); i++) {
+			if (tasks[i].executor != nullptr && pending[i] == 0)
+				submit(i);
+		}
+		for (int i = 0; i < tasks.size(); i++) {
+			if (tasks[i].executor != nullptr) continue;
+			execute(i);
+			tasks[i].done.get();
+		}
+	}
+
+	/*
+	Block until a task has finished, rethrows its exception
+	*/
+	void wait(int task) { tasks[task].done.get(); }
+
+	std::shared_future<void> future(int task) const { return tasks[task].done; }
+
+	// Seconds since run() was called
+	float elapsed() const { return secondsSinceStart(); }
+};
+
+#endif // TASK_GRAPH
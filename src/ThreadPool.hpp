@@ -0,0 +1,213 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#if _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "MemoryTracker.hpp"
+#include "NumaTopology.hpp"
+
+/*
+Fixed set of worker threads that live as long as the scene, shared by everything that runs
+in parallel (acceleration structure build, ray tracing, supersampling and image output).
+Work is submitted as tasks, optionally the workers are pinned to a core each so the
+operating system does not move them (and their caches) around. A task allocates under the
+MemoryTracker tag of the thread that submitted it.
+Given a NUMA topology the workers are spread over the nodes in contiguous groups
+(workers 0..k-1 on node 0 and so on), and a task can be sent to one specific worker.
+*/
+class ThreadPool {
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	// tasks that have to run on one specific worker (submitTo)
+	std::vector<std::deque<std::function<void()>>> workerTasks;
+	// NUMA node of every worker
+	std::vector<int> workerNode;
+	int nodeCount = 1;
+	std::mutex lock;
+	std::condition_variable available;
+	bool stopping = false;
+
+	// index of the worker running on this thread, -1 for threads outside the pool
+	static int& workerIndex() {
+		thread_local int index = -1;
+		return index;
+	}
+
+	// pool the worker running on this thread belongs to
+	static ThreadPool*& workerPool() {
+		thread_local ThreadPool* owner = nullptr;
+		return owner;
+	}
+
+	void work(int index) {
+		workerIndex() = index;
+		workerPool() = this;
+		while (true) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> guard(lock);
+				std::deque<std::function<void()>>& own = workerTasks[index];
+				available.wait(guard, [this, &own] { return stopping || !own.empty() || !tasks.empty(); });
+				if (!own.empty()) {
+					task = std::move(own.front());
+					own.pop_front();
+				}
+				else if (!tasks.empty()) {
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				}
+				else return;
+			}
+			task();
+		}
+	}
+
+	static void pin(std::thread& thread, int cpu) {
+#if _WIN32
+		SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << (cpu % (8 * sizeof(DWORD_PTR))));
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &set);
+#endif
+	}
+
+public:
+	/*
+	Start the workers, threads = 0 starts one per core (of all nodes)
+	*/
+	ThreadPool(int threads, bool pinThreads, const NumaTopology& topology = NumaTopology::uniform()) {
+		int cores = 0;
+		for (const std::vector<int>& cpus : topology.nodeCpus) cores += cpus.size();
+		if (threads <= 0) threads = std::max(cores, 1);
+		nodeCount = std::max(topology.nodes(), 1);
+
+		// worker i runs on node i * nodes / threads, on the cpus of that node in turn
+		workerTasks.resize(threads);
+		std::vector<int> firstOfNode(nodeCount, -1);
+		for (int i = 0; i < threads; i++) {
+			int node = (int)((long long)i * nodeCount / threads);
+			if (firstOfNode[node] < 0) firstOfNode[node] = i;
+			workerNode.push_back(node);
+		}
+		for (int i = 0; i < threads; i++) {
+			workers.push_back(std::thread(&ThreadPool::work, this, i));
+			int node = workerNode[i];
+			if (pinThreads && topology.nodes() > 0 && !topology.nodeCpus[node].empty()) {
+				const std::vector<int>& cpus = topology.nodeCpus[node];
+				pin(workers.back(), cpus[(i - firstOfNode[node]) % cpus.size()]);
+			}
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		available.notify_all();
+		for (std::thread& t : workers) t.join();
+	}
+
+	int size() const { return workers.size(); }
+
+	/*
+	Index (0 -> size()-1) of the pool worker calling this, -1 if called from another thread
+	*/
+	static int currentWorker() { return workerIndex(); }
+
+	int nodes() const { return nodeCount; }
+
+	// NUMA node the given worker is pinned to
+	int nodeOf(int worker) const { return workerNode[worker]; }
+
+	const std::vector<int>& getWorkerNodes() const { return workerNode; }
+
+	/*
+	Queue a task, the future becomes ready when it has run (and rethrows its exception)
+	*/
+	template <typename Function>
+	std::future<void> submit(Function f) {
+		std::shared_ptr<std::packaged_task<void()>> task(new std::packaged_task<void()>(f));
+		std::future<void> result = task->get_future();
+		MemoryTracker::Tag tag = MemoryTracker::currentTag();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			tasks.push_back([task, tag] {
+				MemoryTracker::Scope scope(tag);
+				(*task)();
+			});
+		}
+		available.notify_one();
+		return result;
+	}
+
+	/*
+	Queue a task that only the given worker may run, e.g. to first-touch memory on its node
+	*/
+	template <typename Function>
+	std::future<void> submitTo(int worker, Function f) {
+		std::shared_ptr<std::packaged_task<void()>> task(new std::packaged_task<void()>(f));
+		std::future<void> result = task->get_future();
+		MemoryTracker::Tag tag = MemoryTracker::currentTag();
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			workerTasks[worker].push_back([task, tag] {
+				MemoryTracker::Scope scope(tag);
+				(*task)();
+			});
+		}
+		// wake everyone, only the chosen worker picks it up
+		available.notify_all();
+		return result;
+	}
+
+	/*
+	Run body(i) for every i in [begin, end) on the workers and wait until all are done.
+	Called from inside a task it runs sequentially, so a worker never waits on its own pool.
+	*/
+	void parallelFor(int begin, int end, const std::function<void(int)>& body) {
+		int n = end - begin;
+		if (n <= 0) return;
+		if (workerPool() == this || size() == 0 || n == 1) {
+			for (int i = begin; i < end; i++) body(i);
+			return;
+		}
+
+		// a few chunks per worker, so uneven iterations still balance out
+		int chunks = std::min(n, size() * 4);
+		std::vector<std::future<void>> done;
+		for (int c = 0; c < chunks; c++) {
+			int chunkBegin = begin + (int)((long long)n * c / chunks);
+			int chunkEnd = begin + (int)((long long)n * (c + 1) / chunks);
+			done.push_back(submit([&body, chunkBegin, chunkEnd] {
+				for (int i = chunkBegin; i < chunkEnd; i++) body(i);
+			}));
+		}
+		for (std::future<void>& f : done) f.get();
+	}
+};
+
+#endif // THREAD_POOL
@@ -0,0 +1,132 @@
+#ifndef __TILE_SCHEDULER__
+#define __TILE_SCHEDULER__
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A rectangle of pixels [x0, x1) x [y0, y1) that is rendered as one unit of work
+struct Tile {
+	int x0, y0, x1, y1;
+};
+
+/*
+Hands out the tiles of an image to a fixed number of workers.
+The tiles are sorted along a Morton (Z-order) curve and every worker gets a contiguous run
+of that order in its own deque, so a worker renders pixels close to each other (good for the
+shadow cache and the caches of the cpu). A worker that runs out of tiles steals from the back
+of another deque, so slow (reflective, shadow-heavy) regions are shared instead of stalling the frame.
+When the NUMA node of every worker is given, a worker first steals from workers on its own node
+and only then from other nodes, so tiles (and the memory they touch) stay on one node where possible.
+*/
+class TileScheduler {
+private:
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	// NUMA node of every worker, all 0 when not given
+	std::vector<int> workerNode;
+	int totalTiles = 0;
+	std::atomic<int> finishedTiles;
+	std::atomic<int> stolenTiles;
+	std::atomic<int> remoteStolenTiles;
+
+	// Interleave the bits of x and y
+	static unsigned int mortonCode(unsigned int x, unsigned int y) {
+		unsigned int code = 0;
+		for (int bit = 0; bit < 16; bit++) {
+			code |= ((x >> bit) & 1u) << (2 * bit);
+			code |= ((y >> bit) & 1u) << (2 * bit + 1);
+		}
+		return code;
+	}
+
+	bool popFront(int worker, Tile& tile) {
+		WorkerQueue& q = *queues[worker];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tiles.empty()) return false;
+		tile = q.tiles.front();
+		q.tiles.pop_front();
+		return true;
+	}
+
+	bool popBack(int worker, Tile& tile) {
+		WorkerQueue& q = *queues[worker];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tiles.empty()) return false;
+		tile = q.tiles.back();
+		q.tiles.pop_back();
+		return true;
+	}
+
+public:
+	TileScheduler(int width, int height, int tileSize, int workers, const std::vector<int>& _workerNode = std::vector<int>())
+		: finishedTiles(0), stolenTiles(0), remoteStolenTiles(0) {
+		workers = std::max(workers, 1);
+		tileSize = std::max(tileSize, 1);
+		workerNode = _workerNode;
+		workerNode.resize(workers, 0);
+
+		std::vector<std::pair<unsigned int, Tile>> ordered;
+		for (int ty = 0; ty * tileSize < height; ty++) {
+			for (int tx = 0; tx * tileSize < width; tx++) {
+				Tile t = { tx * tileSize, ty * tileSize, std::min((tx + 1) * tileSize, width), std::min((ty + 1) * tileSize, height) };
+				ordered.push_back(std::make_pair(mortonCode(tx, ty), t));
+			}
+		}
+		std::sort(ordered.begin(), ordered.end(),
+			[](const std::pair<unsigned int, Tile>& a, const std::pair<unsigned int, Tile>& b) { return a.first < b.first; });
+		totalTiles = ordered.size();
+
+		// worker w starts with the w-th contiguous part of the curve
+		// (the workers of a node are numbered contiguously, so a node also gets one region)
+		for (int w = 0; w < workers; w++) {
+			queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+			int start = (int)((long long)totalTiles * w / workers);
+			int end = (int)((long long)totalTiles * (w + 1) / workers);
+			for (int i = start; i < end; i++) queues[w]->tiles.push_back(ordered[i].second);
+		}
+	}
+
+	/*
+	Get the next tile for a worker, from its own deque or stolen from another one
+	Returns false when all tiles have been handed out
+	*/
+	bool next(int worker, Tile& tile) {
+		if (popFront(worker, tile)) return true;
+
+		// first pass steals on the same node, second pass from the other nodes
+		int workers = queues.size();
+		for (int pass = 0; pass < 2; pass++) {
+			for (int i = 1; i < workers; i++) {
+				int victim = (worker + i) % workers;
+				bool sameNode = workerNode[victim] == workerNode[worker];
+				if (sameNode != (pass == 0)) continue;
+				if (popBack(victim, tile)) {
+					stolenTiles++;
+					if (!sameNode) remoteStolenTiles++;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Called by a worker when it finished rendering a tile
+	void finished() { finishedTiles++; }
+
+	int getTotalTiles() const { return totalTiles; }
+	int getFinishedTiles() const { return finishedTiles; }
+	int getStolenTiles() const { return stolenTiles; }
+	// tiles stolen from a worker on another NUMA node
+	int getRemoteStolenTiles() const { return remoteStolenTiles; }
+	int getWorkers() const { return queues.size(); }
+};
+
+#endif // TILE_SCHEDULER
@@ -0,0 +1,53 @@
+#ifndef __TRACE_POLICY__
+#define __TRACE_POLICY__
+
+#include <string>
+
+// Structure used to find the faces a ray can hit
+enum class AccelBackend {
+	None,			// test every face of the mesh
+	BoundingBoxes	// only test the faces inside the boxes of the AccelerationStructure
+};
+
+/*
+Compile-time description of a tracing kernel. The tracing methods of Flyscene are templated
+on a policy, so every check on these values is a constant the compiler removes, and the
+production kernel contains no debug or feature branches at all.
+*/
+template <bool Debug, AccelBackend Accel, bool Shadows, bool Reflections>
+struct TracePolicy {
+	// Record debug rays for the 3D view
+	static const bool debug = Debug;
+	static const AccelBackend accel = Accel;
+	// Trace shadow rays to the sampling points of the lights
+	static const bool shadows = Shadows;
+	// Follow reflections of materials with illumination model 3
+	static const bool reflections = Reflections;
+};
+
+typedef TracePolicy<false, AccelBackend::BoundingBoxes, true, true> ProductionPolicy;
+typedef TracePolicy<true, AccelBackend::BoundingBoxes, true, true> DebugPolicy;
+typedef TracePolicy<false, AccelBackend::None, true, true> BruteForcePolicy;
+typedef TracePolicy<false, AccelBackend::BoundingBoxes, false, true> NoShadowsPolicy;
+typedef TracePolicy<false, AccelBackend::BoundingBoxes, true, false> NoReflectionsPolicy;
+
+// Kernels that can be selected at runtime, all of them are compiled into the binary
+enum class TraceVariant {
+	Production,
+	BruteForce,
+	NoShadows,
+	NoReflections,
+	Count
+};
+
+inline std::string traceVariantName(TraceVariant variant) {
+	switch (variant) {
+	case TraceVariant::Production: return "production";
+	case TraceVariant::BruteForce: return "brute force";
+	case TraceVariant::NoShadows: return "no shadows";
+	case TraceVariant::NoReflections: return "no reflections";
+	default: return "unknown";
+	}
+}
+
+#endif // TRACE_POLICY
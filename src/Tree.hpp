@@ -4,11 +4,11 @@
 #include <Eigen/Dense>
 #include <cmath>
 #include "box.hpp"
-#include <tucano/mesh.hpp>
+#include "SceneGeometry.hpp"
 
 
 class Tree {
-	Tucano::Mesh mesh;
+	const SceneGeometry* geometry = nullptr;
 	vector<Box> boxes;
 	vector<vector<int>> faceBuckets;
 	int size = 0;
@@ -23,9 +23,9 @@ class Tree {
 public:
 	Tree() {}
 
-	Tree(Tucano::Mesh& _mesh, int _threshold, int _facesPerBox) {
+	Tree(const SceneGeometry& _geometry, int _threshold, int _facesPerBox) {
 		vector<int> meshFaces;
-		this->mesh = _mesh;
+		this->geometry = &_geometry;
 		this->threshold = _threshold;
 		this->size = pow(2, threshold) - 1;
 		this->boxes.resize(size);
@@ -33,9 +33,9 @@ public:
 		this->facesPerBox = _facesPerBox;
 
 		for (int i = 0; i < size; i++)	this->boxes[i] = Box();
-		for (int j = 0; j < mesh.getNumberOfFaces(); j++) meshFaces.push_back(j);
+		for (int j = 0; j < geometry->faceCount; j++) meshFaces.push_back(j);
 
-		this->boxes[0] = Box::generateBoundingBox(mesh);
+		this->boxes[0] = Box::generateBoundingBox(*geometry);
 		this->faceBuckets[0] = meshFaces;
 	}
 
@@ -128,10 +128,8 @@ public:
 		//*****************************************
 
 		//***************Faces Split***************
-		Eigen::Affine3f shapeModelMatrix = mesh.getShapeMatrix();
 		vector<int> leftFaces, rightFaces;
 		vector<float> resizeLeft, resizeRight;
-		vector<GLuint> verts;
 		float v0, v1, v2;
 		int matchingLeft;
 
@@ -142,11 +140,9 @@ public:
 		for (int faceId : faces) {
 			matchingLeft = 0;
 
-			verts = mesh.getFace(faceId).vertex_ids;
-
-			v0 = (shapeModelMatrix * mesh.getVertex(verts[0]))[splitAxis];
-			v1 = (shapeModelMatrix * mesh.getVertex(verts[1]))[splitAxis];;
-			v2 = (shapeModelMatrix * mesh.getVertex(verts[2]))[splitAxis];;
+			v0 = geometry->vertex(faceId, 0)[splitAxis];
+			v1 = geometry->vertex(faceId, 1)[splitAxis];
+			v2 = geometry->vertex(faceId, 2)[splitAxis];
 
 			if (v0 < centerLongestAxis) matchingLeft++;
 			if (v1 < centerLongestAxis) matchingLeft++;
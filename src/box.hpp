@@ -2,8 +2,13 @@
 #define __AABB__
 
 #include <Eigen/Dense>
+#include <cfloat>
 #include <cmath>
-#include <tucano/mesh.hpp>
+#include <utility>
+#include <vector>
+#include "SceneGeometry.hpp"
+
+using std::vector;
 
 class Box {
 public:
@@ -44,12 +49,12 @@ public:
 		float tXmin = (min.x() - origin.x()) / rayDirection.x();
 		float tXmax = (max.x() - origin.x()) / rayDirection.x();
 
-		if (tXmin > tXmax) swap(tXmin, tXmax);
+		if (tXmin > tXmax) std::swap(tXmin, tXmax);
 
 		float tYmin = (min.y() - origin.y()) / rayDirection.y();
 		float tYmax = (max.y() - origin.y()) / rayDirection.y();
 
-		if (tYmin > tYmax) swap(tYmin, tYmax);
+		if (tYmin > tYmax) std::swap(tYmin, tYmax);
 
 		if ((tXmin > tYmax) || (tYmin > tXmax))
 			return false;
@@ -63,7 +68,7 @@ public:
 		float tZmin = (min.z() - origin.z()) / rayDirection.z();
 		float tZmax = (max.z() - origin.z()) / rayDirection.z();
 
-		if (tZmin > tZmax) swap(tZmin, tZmax);
+		if (tZmin > tZmax) std::swap(tZmin, tZmax);
 
 		if ((tXmin > tZmax) || (tZmin > tXmax))
 			return false;
@@ -76,7 +81,8 @@ public:
 		return true;
 	}
 
-	static Box generateBoundingBox(Tucano::Mesh mesh) {
+	// Box around all vertices of the scene, holding all of its faces
+	static Box generateBoundingBox(const SceneGeometry& geometry) {
 		float xMin = FLT_MAX;
 		float yMin = FLT_MAX;
 		float zMin = FLT_MAX;
@@ -84,9 +90,9 @@ public:
 		float yMax = FLT_MIN;
 		float zMax = FLT_MIN;
 
-		for (int i = 0; i < mesh.getNumberOfVertices(); i++) {
+		for (uint32_t i = 0; i < geometry.vertexCount; i++) {
 			
-			Eigen::Vector3f v = mesh.getShapeModelMatrix() * mesh.getVertex(i).head<3>();
+			Eigen::Vector3f v = geometry.position(i);
 			//x
 			if (v.x() > xMax) xMax = v.x();
 			if (v.x() < xMin) xMin = v.x();
@@ -99,7 +105,7 @@ public:
 		}
 		
 		vector<int> f;
-		for (int i = 0; i < mesh.getNumberOfFaces(); i++) {
+		for (uint32_t i = 0; i < geometry.faceCount; i++) {
 			f.push_back(i);
 		}
 
@@ -133,16 +139,8 @@ public:
 		return absLengths.x() * absLengths.y() * absLengths.z();
 	}
 
-	void addFace(int face, Tucano::Mesh &mesh) {
+	void addFace(int face) {
 		this->face_indexs.push_back(face);
-		Tucano::Face f = mesh.getFace(face);
-		Eigen::Vector3f v0 = mesh.getShapeModelMatrix() * mesh.getVertex(f.vertex_ids[0]).head<3>();
-		Eigen::Vector3f v1 = mesh.getShapeModelMatrix() * mesh.getVertex(f.vertex_ids[1]).head<3>();
-		Eigen::Vector3f v2 = mesh.getShapeModelMatrix() * mesh.getVertex(f.vertex_ids[2]).head<3>();
-		
-		//computeResize(v0);
-		//computeResize(v1);
-		//computeResize(v2);
 	}
 
 	void computeResize(Eigen::Vector3f v) {
@@ -156,12 +154,10 @@ public:
 		if (v.z() < min.z()) min[2] = v.z();
 	}
 
-	int verticesInBox(int face, Tucano::Mesh& mesh) {
+	int verticesInBox(int face, const SceneGeometry& geometry) {
 		int count = 0;
-		Tucano::Face f = mesh.getFace(face);
-		for (int i = 0; i < f.vertex_ids.size(); i++) {
-			Eigen::Vector3f v = (mesh.getShapeModelMatrix() * mesh.getVertex(f.vertex_ids[i])).head<3>();
-			if (inBox(v)) count++;
+		for (int i = 0; i < 3; i++) {
+			if (inBox(geometry.vertex(face, i))) count++;
 		}
 		return count;
 	}
@@ -172,13 +168,12 @@ public:
 	}
 
 
-	float checkDistance(int index, Tucano::Mesh &mesh) {
-		Tucano::Face face = mesh.getFace(index);
+	float checkDistance(int index, const SceneGeometry& geometry) {
 		Eigen::Vector3f cb = this->getBoxCenter();
 
-		Eigen::Vector3f ct = mesh.getShapeModelMatrix() * mesh.getVertex(face.vertex_ids[0]).head<3>();
-		ct += mesh.getShapeModelMatrix() * mesh.getVertex(face.vertex_ids[1]).head<3>();
-		ct += mesh.getShapeModelMatrix() * mesh.getVertex(face.vertex_ids[2]).head<3>();
+		Eigen::Vector3f ct = geometry.vertex(index, 0);
+		ct += geometry.vertex(index, 1);
+		ct += geometry.vertex(index, 2);
 		ct /= 3;
 
 		return  sqrt(pow(cb.x() - ct.x(), 2) + pow(cb.y() - ct.y(), 2) + pow(cb.z() - ct.z(), 2));
@@ -210,7 +205,7 @@ public:
 		if (zLength >= xLength && zLength >= yLength) return 2;
 	}
 
-	void computeBoundigBox(Tucano::Mesh &mesh) {
+	void computeBoundigBox(const SceneGeometry& geometry) {
 		float xMin = FLT_MAX;
 		float yMin = FLT_MAX;
 		float zMin = FLT_MAX;
@@ -219,9 +214,8 @@ public:
 		float zMax = FLT_MIN;
 
 		for (int i = 0; i < face_indexs.size(); i++) {
-			Tucano::Face face = mesh.getFace(face_indexs[i]);
-			for (int j = 0; j < face.vertex_ids.size(); j++) {
-				Eigen::Vector3f v = mesh.getShapeModelMatrix() * mesh.getVertex(face.vertex_ids[j]).head<3>();
+			for (int j = 0; j < 3; j++) {
+				Eigen::Vector3f v = geometry.vertex(face_indexs[i], j);
 				//x
 				if (v.x() > xMax) xMax = v.x();
 				if (v.x() < xMin) xMin = v.x();
@@ -2,7 +2,12 @@
 #include <GLFW/glfw3.h>
 #include <ppl.h>
 #include <chrono>
+#include <numeric>
 #include <thread>
+#include <sstream>
+
+// Copy of the scene used by the render thread, set by the workers in NUMA mode
+static thread_local const SceneGeometry* nodeScene = nullptr;
 
 void Flyscene::initialize(int width, int height) {
   // initiliaze the Phong Shading effect for the Opengl Previewer
@@ -11,17 +16,178 @@ void Flyscene::initialize(int width, int height) {
   // set the camera's projection matrix
   flycamera.setPerspectiveMatrix(60.0, width / (float)height, 0.1f, 100.0f);
   flycamera.setViewport(Eigen::Vector2f((float)width, (float)height));
+  settings.print();
+
+  // Start the worker threads shared by the scene loading, acceleration structure build, ray tracing and image output
+  // in NUMA mode the workers are always pinned, otherwise they would not stay on their node
+  bool numa = settings.numa && settings.multithreading;
+  bool pinThreads = settings.pinThreads || numa;
+  NumaTopology topology = numa ? NumaTopology::detect() : NumaTopology::uniform();
+  pool.reset(new ThreadPool(settings.threads, pinThreads, topology));
+  std::cout << "Thread pool: " << pool->size() << " threads" << (pinThreads ? " (pinned)" : "");
+  if (numa) std::cout << " on " << pool->nodes() << " NUMA node(s)";
+  std::cout << std::endl;
+
+  // Background renders run on their own thread, so the viewer keeps going while they trace
+  renderThread.reset(new ThreadPool(1, false));
+
+  // Load the scene as a graph of tasks: the OBJ and MTL files are read at the same time, the vertex
+  // normals are computed while the vertices are uploaded to OpenGL (which has to happen on this thread)
+  // and the acceleration structure is built in the background while the viewer already runs
+  startup.reset(new TaskGraph());
+  TaskGraph& graph = *startup;
+  bool compiled = RtScene::isCompiled(settings.model);
+  std::shared_ptr<ObjData> obj(new ObjData());
+  std::shared_ptr<vector<int>> groupMaterials(new vector<int>());
+  std::shared_ptr<Eigen::Affine3f> shapeMatrix(new Eigen::Affine3f(Eigen::Affine3f::Identity()));
+  int meshLoaded;
+
+  if (compiled) {
+	  // a compiled scene is only mapped, the tracer reads the triangles (and boxes) where they are in the file
+	  if (!sceneFile.open(settings.model, settings.verifyScene)) exit(1);
+	  geometry = sceneFile.geometry();
+	  sceneFile.loadMaterials(materials);
+
+	  meshLoaded = graph.add("upload mesh", nullptr, [this] {
+		  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+		  sceneFile.loadMesh(mesh);
+
+		  std::cout << "RTSCENE info:" << std::endl;
+		  std::cout << "number vertices : " << geometry.vertexCount << std::endl;
+		  std::cout << "number faces : " << geometry.faceCount << std::endl;
+		  std::cout << "number materials : " << materials.size() << std::endl;
+		  std::cout << "number boxes : " << geometry.boxCount << std::endl;
+	  });
+  }
+  else {
+	  // PLY files have no materials, their vertex normals are only computed when the file has none
+	  bool ply = PlyLoader::isPly(settings.model);
+	  std::shared_ptr<bool> libraryLoaded(new bool(false));
+
+	  // parsed from the render thread (idle until the acceleration structure is built), so the chunks of the file can use all workers
+	  int parse = graph.add(ply ? "parse ply" : "parse obj", renderThread.get(), [this, obj, ply] {
+		  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+		  if (ply) PlyLoader::parse(settings.model, *obj, pool.get());
+		  else ObjLoader::parse(settings.model, *obj, pool.get());
+	  });
+	  vector<int> facesDependencies;
+	  if (!ply) {
+		  facesDependencies.push_back(graph.add("load mtl", pool.get(), [this, libraryLoaded] {
+			  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+			  std::string library = ObjLoader::findMaterialLibrary(settings.model);
+			  if (library.empty()) return;
+			  Tucano::MaterialImporter::loadMTL(materials, library);
+			  *libraryLoaded = true;
+		  }));
+	  }
+	  int normals = graph.add("vertex normals", pool.get(), [obj, ply] {
+		  // the vertex normals are only used by the preview
+		  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+		  if (!ply || obj->normals.empty()) ObjLoader::computeNormals(*obj);
+	  }, { parse });
+
+	  // the mesh is only the preview, it keeps no copy of the data: the tracer reads the scene geometry
+	  int vertices = graph.add("upload vertices", nullptr, [this, obj, shapeMatrix] {
+		  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+		  if (!obj->vertices.empty()) mesh.loadVertices(obj->vertices);
+		  if (!obj->texCoords.empty()) mesh.loadTexCoords(obj->texCoords);
+		  if (!obj->colors.empty()) mesh.loadColors(obj->colors);
+		  // normalize the model (scale to unit cube and center at origin)
+		  mesh.normalizeModelMatrix();
+		  *shapeMatrix = mesh.getShapeModelMatrix();
+	  }, { parse });
+	  int normalsUpload = graph.add("upload normals", nullptr, [this, obj] {
+		  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+		  if (!obj->normals.empty()) mesh.loadNormals(obj->normals);
+	  }, { normals, vertices });
+	  facesDependencies.push_back(normalsUpload);
+	  meshLoaded = graph.add("upload faces", nullptr, [this, obj, ply, libraryLoaded, groupMaterials] {
+		  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+		  // material libraries after the first face are only found by the full parse
+		  for (int i = *libraryLoaded ? 1 : 0; i < obj->materialLibraries.size(); ++i)
+			  Tucano::MaterialImporter::loadMTL(materials, obj->materialLibraries[i]);
+
+		  *groupMaterials = ObjLoader::resolveMaterials(*obj, materials);
+		  // faces without a material (all of them in a PLY file) get a default one, the tracer shades every face
+		  if (std::find(groupMaterials->begin(), groupMaterials->end(), -1) != groupMaterials->end()) {
+			  for (int& material : *groupMaterials)
+				  if (material < 0) material = materials.size();
+			  materials.push_back(ObjLoader::defaultMaterial());
+		  }
+		  for (int i = 0; i < obj->groups.size(); ++i) {
+			  if (obj->groups[i].empty()) continue;
+			  mesh.loadIndices(obj->groups[i], (*groupMaterials)[i]);
+		  }
+		  mesh.setDefaultAttribLocations();
+
+		  std::cout << (ply ? "PLY info:" : "OBJ info:") << std::endl;
+		  std::cout << "number vertices : " << mesh.getNumberOfVertices() << std::endl;
+		  std::cout << "number faces : " << mesh.getNumberOfElements() << std::endl;
+		  std::cout << "number materials : " << mesh.getNumberOfMaterials() << std::endl;
+	  }, facesDependencies);
+  }
+  graph.add("phong materials", nullptr, [this] {
+	  MemoryTracker::Scope scope(MemoryTracker::Viewer);
+	  // pass all the materials to the Phong Shader
+	  for (int i = 0; i < materials.size(); ++i)
+		  phong.addMaterial(materials[i]);
+  }, { meshLoaded });
+
+  // the materials of a compiled scene are read before the graph runs
+  int materialsCompiled = graph.add("material table", pool.get(), [this] {
+	  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+	  if (!materialTable.compile(materials)) {
+		  std::cerr << "The scene has " << materials.size() << " materials, at most " << MaterialTable::maxMaterials << " are supported" << std::endl;
+		  exit(1);
+	  }
+  }, compiled ? vector<int>() : vector<int>{ meshLoaded });
+
+  // the boxes stored in a compiled scene do not fit the positions of the compact mode
+  int accel;
+  if (compiled && sceneFile.hasBoxes() && !quantizing()) {
+	  accel = graph.add("replicate scene", renderThread.get(), [this] {
+		  {
+			  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+			  pageScene();
+			  replicateScene();
+		  }
+		  MemoryTracker::print("after loading the scene");
+	  }, { materialsCompiled });
+  }
+  else {
+	  // the render thread builds it, so the build can still use all workers of the pool
+	  accel = graph.add("acceleration structure", renderThread.get(), [this, obj, groupMaterials, shapeMatrix, compiled] {
+		  {
+			  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+			  // a compiled scene without boxes builds them from its mapped triangles
+			  if (!compiled) {
+				  sceneBuffers.setTriangles(*obj, *groupMaterials, *shapeMatrix, pool.get());
+				  preprocessScene();
+				  geometry = sceneBuffers.view();
+			  }
+			  quantizeScene();
+			  buildAccelerationStructure();
+			  pageScene();
+			  replicateScene();
+		  }
+		  MemoryTracker::print("after building the scene");
+	  }, { meshLoaded, materialsCompiled });
+  }
 
-  // load the OBJ file and materials
-  Tucano::MeshImporter::loadObjFile(mesh, materials,
-                                    "resources/models/scene5.obj");
+  // the offline compile step writes what was loaded, main exits once it is done
+  int ready = accel;
+  if (!settings.compileScene.empty()) {
+	  if (compiled)
+		  std::cout << settings.model << " is already compiled, nothing written" << std::endl;
+	  else
+		  ready = graph.add("compile rtscene", renderThread.get(), [this, obj] {
+			  MemoryTracker::Scope scope(MemoryTracker::Geometry);
+			  writeCompiledScene(*obj);
+		  }, { accel });
+  }
 
-  // normalize the model (scale to unit cube and center at origin)
-  mesh.normalizeModelMatrix();
-   
-  // pass all the materials to the Phong Shader
-  for (int i = 0; i < materials.size(); ++i)
-    phong.addMaterial(materials[i]);
+  graph.run();
+  sceneReady = graph.future(ready);
 
   // scale the camera representation (frustum) for the ray debug
   camerarep.shapeMatrix()->scale(0.2);
@@ -33,24 +199,174 @@ void Flyscene::initialize(int width, int height) {
   glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
   
   // Create first random light 
-  lights.push_back(SphereLight(Eigen::Vector3f(0.0, 3.0, 0.0), Eigen::Vector3f(0.7, 0.7, 0.7), 0.3f));
+  addSceneLight(SphereLight(Eigen::Vector3f(0.0, 3.0, 0.0), Eigen::Vector3f(0.7, 0.7, 0.7), 0.3f, settings.samplingPointsPerRadius));
+  std::cout << "Startup: viewer ready after " << graph.elapsed() << " s" << std::endl;
+}
 
-  // Create little spheres for sampling points to be used for soft shadowing
-  for (int i = 0; i < lights.size(); i++) {
-	  vector<Eigen::Vector3f> sp = lights[i].getSamplingPoints();
-	  for (int j = 0; j < sp.size(); j++) {
-		  samplingPoints.push_back(SphereLight(sp[j], Eigen::Vector3f(0.1, 0.1, 0.1), 0.01f));
+bool Flyscene::sceneLoaded() {
+  return sceneReady.valid() && sceneReady.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void Flyscene::waitForScene() {
+  if (sceneReady.valid()) sceneReady.get();
+}
+
+void Flyscene::buildAccelerationStructure() {
+  MemoryTracker::Scope scope(MemoryTracker::Acceleration);
+  // only the boxes are kept, the structure reads the triangles of the geometry and is dropped
+  AccelerationStructure as(geometry, settings.maxFacesPerBox, settings.maxOverlap, pool.get());
+  sceneBuffers.setBoxes(as.getBoxes());
+  sceneBuffers.attachBoxes(geometry);
+}
+
+void Flyscene::preprocessScene() {
+  if (!settings.preprocessGeometry) return;
+  uint32_t vertexCount = sceneBuffers.vertices.size() / 3;
+  uint32_t faceCount = sceneBuffers.faceMaterials.size();
+  SceneBuffers::PreprocessStats stats = sceneBuffers.preprocess(settings.weldTolerance, pool.get());
+  std::cout << "Preprocessing: " << vertexCount << " -> " << sceneBuffers.vertices.size() / 3 << " vertices (" << stats.weldedVertices
+	  << " welded or unused), " << faceCount << " -> " << sceneBuffers.faceMaterials.size() << " faces (" << stats.degenerateFaces
+	  << " degenerate, " << stats.duplicateFaces << " duplicates), sorted along a Morton curve" << std::endl;
+}
+
+bool Flyscene::quantizing() const {
+  // the compile step writes the scene at full precision
+  return settings.quantizeVertices && settings.compileScene.empty();
+}
+
+void Flyscene::quantizeScene() {
+  if (!quantizing()) return;
+
+  // a compiled scene is copied out of its mapping
+  if (RtScene::isCompiled(settings.model)) sceneBuffers = SceneBuffers(geometry);
+  size_t positionBytes = sceneBuffers.positionAndNormalBytes();
+  size_t triangleBytes = sceneBuffers.triangleBytes();
+  size_t sceneBytes = sceneBuffers.bytes() - sceneBuffers.boxes.size() * sizeof(GeometryBox) - sceneBuffers.boxFaces.size() * sizeof(uint32_t);
+  sceneBuffers.quantize(pool.get());
+  geometry = sceneBuffers.view();
+
+  float megabytes = 1024.0f * 1024.0f;
+  size_t quantizedPositionBytes = sceneBuffers.positionAndNormalBytes();
+  size_t quantizedTriangleBytes = sceneBuffers.triangleBytes();
+  size_t quantizedSceneBytes = sceneBytes - positionBytes - triangleBytes + quantizedPositionBytes + quantizedTriangleBytes;
+  std::cout << "Compact geometry: positions and normals " << positionBytes / megabytes << " MB -> " << quantizedPositionBytes / megabytes << " MB ("
+	  << (float)positionBytes / std::max(quantizedPositionBytes, (size_t)1) << "x), vertex ids " << triangleBytes / megabytes << " MB -> "
+	  << quantizedTriangleBytes / megabytes << " MB (" << sceneBuffers.farCorners.size() << " far corners), triangles " << sceneBytes / megabytes
+	  << " MB -> " << quantizedSceneBytes / megabytes << " MB (" << (float)sceneBytes / std::max(quantizedSceneBytes, (size_t)1) << "x)" << std::endl;
+}
+
+void Flyscene::pageScene() {
+  // the compile step writes the scene from memory
+  if (settings.pageCacheMb <= 0 || !settings.compileScene.empty()) return;
+
+  vector<GeometryBox> boxes;
+  if (!geometry.writePages(settings.pageFile, boxes)) {
+	  std::cerr << "Cannot write " << settings.pageFile << ", the scene stays in memory" << std::endl;
+	  return;
+  }
+  // faces are read by the workers, the render thread (single threaded renders) and the viewer (debug rays)
+  if (!pages.open(settings.pageFile, (size_t)settings.pageCacheMb * 1024 * 1024, pool->size() + 2)) return;
+  pagedBoxes.swap(boxes);
+
+  SceneGeometry paged;
+  paged.pages = &pages;
+  paged.faceCount = pages.size();
+  paged.boxes = pagedBoxes.data();
+  paged.boxCount = pagedBoxes.size();
+  geometry = paged;
+  // a compiled scene stays mapped, the operating system drops its pages when memory runs low
+  sceneBuffers = SceneBuffers();
+
+  std::cout << "Out of core: " << pages.size() << " faces (" << pagedBoxes.size() << " boxes) in " << pages.pages() << " pages of "
+	  << GeometryPages::facesPerPage << " faces in " << settings.pageFile << ", cache of " << settings.pageCacheMb << " MB" << std::endl;
+}
+
+void Flyscene::replicateScene() {
+  // out of core every node reads through the same page cache
+  if (!settings.numa || !settings.multithreading || geometry.pages != nullptr) return;
+
+  // Give every node its own copy of the triangles and boxes, made by a worker of that node
+  // so the memory is first touched (and therefore allocated) on that node
+  nodeBuffers.resize(pool->nodes());
+  nodeScenes.resize(pool->nodes());
+  vector<std::future<void>> done;
+  for (int node = 0; node < pool->nodes(); ++node) {
+	  for (int worker = 0; worker < pool->size(); ++worker) {
+		  if (pool->nodeOf(worker) != node) continue;
+		  done.push_back(pool->submitTo(worker, [this, node] {
+			  nodeBuffers[node].reset(new SceneBuffers(geometry));
+			  nodeScenes[node] = nodeBuffers[node]->view();
+		  }));
+		  break;
 	  }
   }
-#ifdef ACCEL_STRUCTURE
-  // Create acceleration structure
-  as = AccelerationStructure(mesh, MAX_FACES_PER_BOX, MAX_OVERLAP);
-#endif
+  for (int i = 0; i < done.size(); ++i)
+	  done[i].get();
+  std::cout << "NUMA: scene replicated on " << done.size() << " node(s)" << std::endl;
+}
+
+void Flyscene::writeCompiledScene(const ObjData& obj) {
+  // the preprocessing sorts the faces by position, they are written ordered by material (and by position
+  // within a material) so every material is one group, the boxes keep their faces under the new ids
+  vector<uint32_t> order(geometry.faceCount);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return geometry.faceMaterials[a] < geometry.faceMaterials[b]; });
+  vector<uint32_t> newIds(geometry.faceCount);
+  vector<uint32_t> triangles(3 * (size_t)geometry.faceCount);
+  vector<float> faceNormals(3 * (size_t)geometry.faceCount);
+  vector<MaterialId> faceMaterials(geometry.faceCount);
+  vector<RtScene::Group> groups;
+  for (uint32_t i = 0; i < geometry.faceCount; ++i) {
+	  uint32_t f = order[i];
+	  newIds[f] = i;
+	  for (int k = 0; k < 3; ++k) {
+		  triangles[3 * i + k] = geometry.triangles[3 * f + k];
+		  faceNormals[3 * i + k] = geometry.faceNormals[3 * f + k];
+	  }
+	  faceMaterials[i] = geometry.faceMaterials[f];
+	  if (groups.empty() || groups.back().material != faceMaterials[i]) {
+		  RtScene::Group group;
+		  group.material = faceMaterials[i];
+		  group.firstFace = i;
+		  group.faceCount = 0;
+		  groups.push_back(group);
+	  }
+	  groups.back().faceCount++;
+  }
+  vector<uint32_t> boxFaces(geometry.boxFaceCount);
+  for (uint32_t i = 0; i < geometry.boxFaceCount; ++i)
+	  boxFaces[i] = newIds[geometry.boxFaces[i]];
+  SceneGeometry compiled = geometry;
+  compiled.triangles = triangles.data();
+  compiled.faceNormals = faceNormals.data();
+  compiled.faceMaterials = faceMaterials.data();
+  compiled.boxFaces = boxFaces.data();
+
+  // the viewer's vertex normals follow the vertices if the preprocessing renumbered them
+  const vector<uint32_t>& sources = sceneBuffers.vertexSources;
+  vector<Eigen::Vector3f> normals(sources.size(), Eigen::Vector3f::Zero());
+  for (int i = 0; i < sources.size(); ++i)
+	  if (sources[i] < obj.normals.size()) normals[i] = obj.normals[sources[i]];
+
+  RtScene written;
+  if (!RtScene::write(settings.compileScene, compiled, sources.empty() ? obj.normals : normals, materials, groups))
+	  std::cerr << "Cannot write " << settings.compileScene << std::endl;
+  // every id of the new file is checked once, so loading it later only has to read the header
+  else if (written.open(settings.compileScene, true))
+	  std::cout << "Compiled scene written to " << settings.compileScene << " (" << geometry.faceCount << " faces, "
+		  << geometry.boxCount << " boxes, " << groups.size() << " groups)" << std::endl;
 }
 
 void Flyscene::paintGL(void) {
+  MemoryTracker::Scope scope(MemoryTracker::Viewer);
   // update the camera view matrix with the last mouse interactions
   flycamera.updateViewMatrix();
+
+  // a background render of the old camera position is restarted from the new one
+  if (renderJob && renderJob->running() && !renderJob->cancelled() && flycamera.getViewMatrix().matrix() != renderView) {
+	  std::cout << std::endl << "Camera moved, restarting the ray tracing" << std::endl;
+	  startRender(renderSize[0], renderSize[1], renderCallback);
+  }
   Eigen::Vector4f viewport = flycamera.getViewport();
 
   // clear the screen and set background color
@@ -85,10 +401,14 @@ void Flyscene::paintGL(void) {
   }
 
   // render bounding Box
-  if (displayBoundingBoxes) {
-	  vector<Tucano::Shapes::Box> aabb = as.getBoxMesh();
-	  for (int i = 0; i < aabb.size(); i++) {
-		  aabb[i].render(flycamera, scene_light);
+  if (displayBoundingBoxes && sceneLoaded()) {
+	  for (uint32_t i = 0; i < geometry.boxCount; i++) {
+		  const GeometryBox& b = geometry.boxes[i];
+		  Tucano::Shapes::Box aabb = Tucano::Shapes::Box(b.max[0] - b.min[0], b.max[1] - b.min[1], b.max[2] - b.min[2]);
+		  aabb.resetModelMatrix();
+		  aabb.modelMatrix()->translate(Eigen::Vector3f((b.min[0] + b.max[0]) / 2.0f, (b.min[1] + b.max[1]) / 2.0f, (b.min[2] + b.max[2]) / 2.0f));
+		  aabb.setColor(Eigen::Vector4f(0.1, 0.1, 1.0, 0.1));
+		  aabb.render(flycamera, scene_light);
 	  }
   }
 
@@ -132,6 +452,7 @@ void Flyscene::simulate(GLFWwindow *window) {
 }
 
 void Flyscene::addLight(void) {
+	cancelRender();
 	std::string input;
 	int choice;
 	float red, green, blue, radius;
@@ -151,30 +472,46 @@ void Flyscene::addLight(void) {
 			std::cin >> input;
 			radius = std::stof(input);
 			if (radius <= 0) throw std::invalid_argument("");
-			l = SphereLight(flycamera.getCenter(), color, radius);
+			l = SphereLight(flycamera.getCenter(), color, radius, settings.samplingPointsPerRadius);
 		}
 		else {
 			l = PointLight(flycamera.getCenter(), color);
 		}
 
-		lights.push_back(l);
-		vector<Eigen::Vector3f> sp = l.getSamplingPoints();
-		for (int j = 0; j < sp.size(); j++) {
-			samplingPoints.push_back(SphereLight(sp[j], Eigen::Vector3f(0.1, 0.1, 0.1), 0.01f));
-		}
+		addSceneLight(l);
+		ShadowCache::invalidateAll();
 	}
 	catch (std::invalid_argument const& e) {
 		std::cout << "Invalid input! Please follow the instructions" << std::endl;
 	}
 }
 
+void Flyscene::addSceneLight(const SphereLight& light) {
+	{
+		MemoryTracker::Scope scope(MemoryTracker::Lights);
+		renderLights.add(light.getLightPosition(), light.getLightColor(), light.getSamplingPoints());
+	}
+	MemoryTracker::Scope scope(MemoryTracker::Viewer);
+	lights.push_back(light);
+
+	// Create little spheres for sampling points to be used for soft shadowing
+	const vector<Eigen::Vector3f>& sp = light.getSamplingPoints();
+	for (int j = 0; j < sp.size(); j++) {
+		samplingPoints.push_back(SphereLight(sp[j], Eigen::Vector3f(0.1, 0.1, 0.1), 0.01f, 0));
+	}
+}
+
 void Flyscene::clearLights() {
+	cancelRender();
 	lights.clear();
+	renderLights.clear();
 	samplingPoints.clear();
 	lightDebugRays.clear();
+	ShadowCache::invalidateAll();
 }
 
 void Flyscene::changeBackground(void) {
+	cancelRender();
 	float red, green, blue;
 	std::cout << "\n";
 	try {
@@ -186,13 +523,15 @@ void Flyscene::changeBackground(void) {
 }
 
 void Flyscene::createDebugRay(const Eigen::Vector2f& mouse_pos) {
+	waitForScene();
 	Eigen::Vector3f origin = flycamera.getCenter();
 	Eigen::Vector3f dest = flycamera.screenToWorld(mouse_pos);
 	displayBoundingBoxes = false;
 	debugRays.clear();
 	normalRays.clear();
 	lightDebugRays.clear();
-	traceRay(origin, dest, 0, true);
+	traceRay<DebugPolicy>(origin, dest, 0);
+	GeometryPages::releaseThreadPages();
 }
 
 void Flyscene::highlightRay() {
@@ -227,214 +566,515 @@ void Flyscene::highlightRay() {
 }
 
 void Flyscene::raytraceScene(int width, int height) {
-  std::cout << "<RAY TRACING STARTED>" << std::endl;
+  startRender(width, height)->wait();
+}
 
-  // if no width or height passed, use dimensions of current viewport
-  Eigen::Vector2i image_size(width, height);
-  if (width == 0 || height == 0) {
-    image_size = flycamera.getViewportSize();
+std::shared_ptr<RenderJob> Flyscene::startRender(int width, int height, RenderJob::Callback onComplete) {
+  // only one render at a time, they share the workers and the output file: the old one is cancelled without
+  // waiting for it (it may still be queued behind the scene build), the new one runs after it on the render thread
+  if (renderJob) renderJob->cancel();
+
+  // the render traces from a copy of the camera, so the viewer can keep moving it
+  Tucano::Camera camera = flycamera;
+  renderView = flycamera.getViewMatrix().matrix();
+  renderSize = Eigen::Vector2i(width, height);
+  renderCallback = onComplete;
+
+  std::shared_ptr<RenderJob> job(new RenderJob(onComplete));
+  TraceVariant variant = traceVariant;
+  job->setFuture(renderThread->submit([this, job, camera, variant, width, height]() mutable {
+	  bool finished = false;
+	  try {
+		  finished = job->start() && renderVariant(variant, camera, width, height, *job);
+	  }
+	  catch (const std::exception& e) {
+		  std::cerr << std::endl << "<RAY TRACING FAILED> " << e.what() << std::endl;
+	  }
+	  GeometryPages::releaseThreadPages();
+	  job->complete(finished);
+  }));
+  renderJob = job;
+  return job;
+}
+
+void Flyscene::cancelRender() {
+  if (!renderJob) return;
+  renderJob->cancel();
+  // a job that has not started yet skips the render once it leaves the queue
+  if (renderJob->started()) renderJob->wait();
+}
+
+bool Flyscene::renderVariant(TraceVariant variant, Tucano::Camera& camera, int width, int height, RenderJob& job) {
+  // select the compiled kernel, so the tracing loop itself never checks the variant
+  switch (variant) {
+  case TraceVariant::BruteForce:
+	  return renderScene<BruteForcePolicy>(camera, width, height, job);
+  case TraceVariant::NoShadows:
+	  return renderScene<NoShadowsPolicy>(camera, width, height, job);
+  case TraceVariant::NoReflections:
+	  return renderScene<NoReflectionsPolicy>(camera, width, height, job);
+  default:
+	  return renderScene<ProductionPolicy>(camera, width, height, job);
   }
+}
 
-  // create 2d vector to hold pixel colors and resize to match image size
-  vector<vector<Eigen::Vector3f>> pixel_data;
-  pixel_data.resize(image_size[1]);
-  for (int i = 0; i < image_size[1]; ++i)
-    pixel_data[i].resize(image_size[0]);
+void Flyscene::benchmarkVariants(int width, int height) {
+  TraceVariant selected = traceVariant;
+  vector<float> times;
 
-  // origin of the ray is always the camera center
-  Eigen::Vector3f origin = flycamera.getCenter();
-  Eigen::Vector3f screen_coords;
+  for (int v = 0; v < (int)TraceVariant::Count; v++) {
+	  traceVariant = (TraceVariant)v;
+	  std::cout << std::endl << "<BENCHMARK: " << traceVariantName(traceVariant) << ">" << std::endl;
+	  auto timeStart = std::chrono::steady_clock::now();
+	  raytraceScene(width, height);
+	  times.push_back(std::chrono::duration<float>(std::chrono::steady_clock::now() - timeStart).count());
+  }
+  traceVariant = selected;
 
+  std::cout << std::endl << "<BENCHMARK RESULTS>" << std::endl;
+  for (int v = 0; v < times.size(); v++)
+	  std::cout << traceVariantName((TraceVariant)v) << ": " << times[v] << " seconds" << std::endl;
+}
 
-#ifdef MULTITHREADING
+void Flyscene::benchmarkLoaders() {
+  // the configured model and the largest shipped ones, from the same directory
+  string path = Tucano::MeshImporter::getPathName(settings.model);
+  vector<string> models = { settings.model, path + "toy.obj", path + "dodgeColorTest.obj", path + "FinalScene.obj", path + "toy.ply", path + "bunny.ply" };
+  std::cout << std::endl << "<SCENE LOADER BENCHMARK>" << std::endl;
+  for (int i = 0; i < models.size(); i++) {
+	  if (std::find(models.begin(), models.begin() + i, models[i]) != models.begin() + i || RtScene::isCompiled(models[i])) continue;
+	  if (PlyLoader::isPly(models[i])) PlyLoader::benchmark(models[i], pool.get());
+	  else ObjLoader::benchmark(models[i], pool.get());
+  }
+}
 
-  int overallCores = std::thread::hardware_concurrency();
-  int parallelElements = overallCores - 1;
-  std::thread* threads = new std::thread[parallelElements];
+void Flyscene::benchmarkFaceLayout() {
+  waitForScene();
+  const SceneGeometry& scene = geometry;
+  if (scene.pages != nullptr || scene.faceCount == 0) {
+	  std::cout << "The face layout benchmark needs the triangles in memory" << std::endl;
+	  return;
+  }
+  std::cout << std::endl << "<FACE LAYOUT BENCHMARK>" << std::endl;
+
+  // the same faces the way Tucano::Mesh keeps them: a heap vector of vertex ids in every face
+  vector<Tucano::Face> faces(scene.faceCount);
+  for (uint32_t f = 0; f < scene.faceCount; f++) {
+	  for (int corner = 0; corner < 3; corner++) faces[f].vertex_ids.push_back(scene.vertexId(f, corner));
+	  faces[f].material_id = scene.faceMaterials[f];
+	  faces[f].normal = scene.normal(f);
+  }
 
-  int coreChunk = int(image_size[1] / parallelElements);
-  int stop = parallelElements * coreChunk;
-  int spare_rows = image_size[1] - stop;
+  float megabytes = 1000000.0f / (1024.0f * 1024.0f);
+  size_t packedBytes = 3 * sizeof(uint32_t) + sizeof(MaterialId) + 3 * sizeof(float);
+  size_t tucanoBytes = sizeof(Tucano::Face) + 3 * sizeof(GLuint);
+  std::cout << "Packed faces: " << packedBytes << " bytes per face, " << packedBytes * megabytes << " MB per million faces" << std::endl;
+  std::cout << "Tucano::Face: " << tucanoBytes << " bytes per face and one heap block (allocator overhead not counted), "
+	  << tucanoBytes * megabytes << " MB per million faces" << std::endl;
+  std::cout << "Saving: " << (tucanoBytes - packedBytes) * megabytes << " MB and " << 1000000 << " allocations per million faces" << std::endl;
+
+  // every ray is tested against every face, from the center of the scene in directions spread over the sphere
+  int rays = std::max(1, (int)(20000000 / scene.faceCount));
+  vector<Eigen::Vector3f> directions(rays);
+  for (int i = 0; i < rays; i++) {
+	  float z = 1.0f - (2.0f * i + 1.0f) / rays;
+	  float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+	  float phi = 2.399963f * i;
+	  directions[i] = Eigen::Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+  }
+  Eigen::Vector3f origin = Eigen::Vector3f::Zero();
+
+  // plane and inside test of intersectTriangle, only the way the face is read differs
+  auto hit = [this, &origin](const Eigen::Vector3f& direction, const Eigen::Vector3f& v0, const Eigen::Vector3f& v1, const Eigen::Vector3f& v2, Eigen::Vector3f normal) {
+	  normal = -normal.normalized();
+	  float denominator = normal.dot(direction);
+	  if (denominator <= 0.0f) return false;
+	  float t = (normal.dot(v0) - normal.dot(origin)) / denominator;
+	  return t > 0 && pointInTriangle(v0, v1, v2, origin + t * direction);
+  };
+
+  auto packedStart = std::chrono::steady_clock::now();
+  long long packedHits = 0;
+  for (int i = 0; i < rays; i++) {
+	  for (uint32_t f = 0; f < scene.faceCount; f++) {
+		  if (hit(directions[i], scene.vertex(f, 0), scene.vertex(f, 1), scene.vertex(f, 2), scene.normal(f))) packedHits++;
+	  }
+  }
+  float packedSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - packedStart).count();
+
+  // a copy of the face per test, as the tracer did with mesh.getFace
+  unsigned long long allocations = AllocationCounter::get();
+  auto tucanoStart = std::chrono::steady_clock::now();
+  long long tucanoHits = 0;
+  for (int i = 0; i < rays; i++) {
+	  for (uint32_t f = 0; f < scene.faceCount; f++) {
+		  Tucano::Face face = faces[f];
+		  Eigen::Vector3f v0 = scene.position(face.vertex_ids[0]);
+		  Eigen::Vector3f v1 = scene.position(face.vertex_ids[1]);
+		  Eigen::Vector3f v2 = scene.position(face.vertex_ids[2]);
+		  if (hit(directions[i], v0, v1, v2, face.normal)) tucanoHits++;
+	  }
+  }
+  float tucanoSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - tucanoStart).count();
+  allocations = AllocationCounter::get() - allocations;
+
+  double tests = (double)rays * scene.faceCount;
+  std::cout << rays << " rays x " << scene.faceCount << " faces" << std::endl;
+  std::cout << "Packed faces: " << packedSeconds << " s, " << tests / packedSeconds / 1000000.0 << " M tests/s, " << packedHits << " hits" << std::endl;
+  std::cout << "Tucano::Face copies: " << tucanoSeconds << " s, " << tests / tucanoSeconds / 1000000.0 << " M tests/s, " << tucanoHits << " hits, "
+	  << allocations << " heap allocations" << std::endl;
+  std::cout << "Speedup: " << tucanoSeconds / packedSeconds << "x" << std::endl;
+}
 
-  //j might not be the most appropriate name 
-  int j = 0;
-  while (j < image_size[1]) {
+template <typename Policy>
+bool Flyscene::renderScene(Tucano::Camera& camera, int width, int height, RenderJob& job) {
+  std::cout << "<RAY TRACING STARTED>" << std::endl;
+  ShadowCache::resetStatistics();
+  RayCounters::resetStatistics();
+  if (geometry.pages != nullptr) pages.resetStatistics();
 
-	  if (j == stop) overallCores = spare_rows + 1;
+  // if no width or height passed, use dimensions of current viewport
+  Eigen::Vector2i image_size(width, height);
+  if (width == 0 || height == 0) {
+    image_size = camera.getViewportSize();
+  }
 
-	  for (int index = 0; index < parallelElements; ++index) {
-		  threads[index] = std::thread([&image_size, j, &origin, this, &pixel_data] {
+  // one buffer for the whole image, its tiles are the tiles of the scheduler
+  ImageBuffer frame;
+  {
+	  MemoryTracker::Scope scope(MemoryTracker::Framebuffer);
+	  frame = ImageBuffer(image_size[0], image_size[1], settings.tileSize);
+  }
 
-			  for (int i = 0; i < image_size[0]; ++i) {
-				  Eigen::Vector3f screen_coords = flycamera.screenToWorld(Eigen::Vector2f(i, j));
-				  pixel_data[i][j] = traceRay(origin, screen_coords, 0, false);
+  // origin of the ray is always the camera center
+  Eigen::Vector3f origin = camera.getCenter();
+
+  // what every pixel cost, taken from the ray counters of the thread tracing it
+  CostImages costs;
+  if (settings.costImages) {
+	  MemoryTracker::Scope scope(MemoryTracker::Framebuffer);
+	  costs = CostImages(image_size[0], image_size[1]);
+  }
+  auto tracePixel = [&](int x, int y) {
+	  Eigen::Vector3f screen_coords = camera.screenToWorld(Eigen::Vector2f(x, y));
+	  if (!costs.enabled()) {
+		  frame.pixel(x, y) = traceRay<Policy>(origin, screen_coords, 0);
+		  return;
+	  }
+	  RayCounters& counters = RayCounters::local();
+	  RayCounters::Counts before = counters.counts;
+	  frame.pixel(x, y) = traceRay<Policy>(origin, screen_coords, 0);
+	  costs.record(x, y, before, counters.counts);
+  };
+
+  auto traceStart = std::chrono::steady_clock::now();
+  ScratchArena& arena = ScratchArena::local();
+  unsigned long long allocationsStart = AllocationCounter::get();
+  // description of how the work was distributed, printed with the timings
+  std::string schedulingInfo = "1 thread";
+
+  if (settings.multithreading) {
+	  int workers = pool->size();
+	  bool numa = !nodeScenes.empty();
+	  TileScheduler scheduler(image_size[0], image_size[1], frame.getTileSize(), workers, pool->getWorkerNodes());
+	  job.setTotalWork(scheduler.getTotalTiles());
+
+	  // rendered tiles and pixels per worker, summed per node afterwards
+	  vector<int> workerTiles(workers, 0);
+	  vector<long long> workerPixels(workers, 0);
+
+	  // one task per worker, each renders tiles until the scheduler runs out
+	  vector<std::future<void>> done;
+	  for (int task = 0; task < workers; ++task) {
+		  done.push_back(pool->submit([&, this] {
+			  int worker = ThreadPool::currentWorker();
+			  ScratchArena& arena = ScratchArena::local();
+			  if (numa) nodeScene = &nodeScenes[pool->nodeOf(worker)];
+
+			  // a tile is one block of the image buffer, the worker rendering it is the first to touch
+			  // that memory, so in NUMA mode it is allocated on the node of the worker
+			  Tile tile;
+			  // a failing worker (a page that cannot be read) stops the others, the error is rethrown below
+			  try {
+				  while (!job.cancelled() && scheduler.next(worker, tile)) {
+					  int tileWidth = tile.x1 - tile.x0;
+					  for (int y = tile.y0; y < tile.y1; ++y) {
+						  for (int x = tile.x0; x < tile.x1; ++x) {
+							  tracePixel(x, y);
+							  arena.reset();
+						  }
+					  }
+					  workerTiles[worker]++;
+					  workerPixels[worker] += tileWidth * (tile.y1 - tile.y0);
+					  scheduler.finished();
+					  job.advance();
+				  }
+			  }
+			  catch (...) {
+				  job.cancel();
+				  nodeScene = nullptr;
+				  GeometryPages::releaseThreadPages();
+				  throw;
 			  }
-			  });
+			  nodeScene = nullptr;
+			  ShadowCache::local().flush();
+			  RayCounters::local().flush();
+			  GeometryPages::releaseThreadPages();
+		  }));
+	  }
 
-		  ++j;
+	  // report progress while the workers are busy
+	  int progress = 0;
+	  while (scheduler.getFinishedTiles() < scheduler.getTotalTiles() && !job.cancelled()) {
+		  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		  int newProgress = (scheduler.getFinishedTiles() * 100) / scheduler.getTotalTiles();
+		  if (newProgress > progress) std::cout << "RayTracing: " << (progress = newProgress) << "%\r";
+		  std::cout.flush();
+	  }
+	  // every worker has to be done before the buffers of this render go away
+	  std::exception_ptr failure;
+	  for (int i = 0; i < done.size(); ++i) {
+		  try {
+			  done[i].get();
+		  }
+		  catch (...) {
+			  failure = std::current_exception();
+		  }
+	  }
+	  if (failure) std::rethrow_exception(failure);
+	  float renderSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - traceStart).count();
+
+	  schedulingInfo = to_string(scheduler.getTotalTiles()) + " tiles on " + to_string(workers) + " threads, "
+		  + to_string(scheduler.getStolenTiles()) + " stolen";
+	  if (numa) {
+		  schedulingInfo += " (" + to_string(scheduler.getRemoteStolenTiles()) + " across nodes)";
+
+		  // throughput of every node over the wall time of the render
+		  std::ostringstream nodeInfo;
+		  for (int node = 0; node < pool->nodes(); ++node) {
+			  int threads = 0, tiles = 0;
+			  long long pixels = 0;
+			  for (int w = 0; w < workers; ++w) {
+				  if (pool->nodeOf(w) != node) continue;
+				  threads++;
+				  tiles += workerTiles[w];
+				  pixels += workerPixels[w];
+			  }
+			  nodeInfo << "\n  Node " << node << ": " << threads << " threads, " << tiles << " tiles, " << pixels << " pixels, "
+				  << (renderSeconds > 0 ? pixels / renderSeconds : 0.0f) << " pixels/s";
+		  }
+		  schedulingInfo += nodeInfo.str();
 	  }
-	  for (int i = 0; i < parallelElements; ++i)
-		  threads[i].join();
   }
-#else // MULTITHREADING
-
-  clock_t timeStart = clock();
-  int progress = 0;
-  for (int i = 0; i < image_size[1]; ++i) {
-	  for (int j = 0; j < image_size[0]; ++j) {
-		  screen_coords = flycamera.screenToWorld(Eigen::Vector2f(i, j));
-		  pixel_data[i][j] = traceRay(origin, screen_coords, 0, false);
+  else {
+	  int progress = 0;
+	  job.setTotalWork(image_size[1]);
+	  for (int y = 0; y < image_size[1] && !job.cancelled(); ++y) {
+		  for (int x = 0; x < image_size[0]; ++x) {
+			  tracePixel(x, y);
+			  // everything traceRay put in the scratch arena is dead after the pixel is done
+			  arena.reset();
+		  }
+		  job.advance();
+		  int newProgress = ((y * 100) / image_size[1]);
+		  if (newProgress > progress) std::cout << "RayTracing: " << (progress = newProgress) << "%\r";
+		  std::cout.flush();
 	  }
-	  int newProgress = ((i * 100) / image_size[1]);
-	  if (newProgress > progress) std::cout << "RayTracing: " << (progress = newProgress) << "%\r";
-	  std::cout.flush();
   }
-  clock_t timeEnd = clock();
+  float traceSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - traceStart).count();
 
-  std::cout << "RayTracing: 100% | Trace time: " << (float)((timeEnd - timeStart) / CLOCKS_PER_SEC) << " seconds" << std::endl;
+  if (job.cancelled()) {
+	  ShadowCache::local().flush();
+	  RayCounters::local().flush();
+	  std::cout << std::endl << "<RAY TRACING CANCELLED>" << std::endl;
+	  return false;
+  }
 
-#endif
-  // write the ray tracing result to a PPM image
-#ifdef SUPERSAMPLING
-  pixel_data = superSampling(pixel_data);
-#endif // SUPERSAMPLING
+  std::cout << "RayTracing: 100% | Trace time: " << traceSeconds << " seconds | " << schedulingInfo << std::endl;
+  std::cout << "Heap allocations in render loop: " << AllocationCounter::get() - allocationsStart
+	  << " (scratch arena blocks: " << arena.getBlockAllocations() << ")" << std::endl;
 
-  Tucano::ImageImporter::writePPMImage("result.ppm", pixel_data);
+  ShadowCache::local().flush();
+  ShadowCache::printStatistics();
+  RayCounters::local().flush();
+  RayCounters::printStatistics(traceSeconds);
+  if (geometry.pages != nullptr) pages.printStatistics();
+
+  // write the ray tracing result to a PPM image
+  auto stageStart = std::chrono::steady_clock::now();
+  if (settings.supersampling) {
+	  frame.downsample();
+	  if (costs.enabled()) costs.downsample();
+  }
+  float supersampleSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - stageStart).count();
+
+  stageStart = std::chrono::steady_clock::now();
+  writePPMImage("result.ppm", frame);
+  if (costs.enabled()) writeCostImages(costs);
+  float writeSeconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - stageStart).count();
+  std::cout << "Stages: trace " << traceSeconds << " s, supersample " << supersampleSeconds << " s, write " << writeSeconds << " s" << std::endl;
+  MemoryTracker::print("after the render");
   std::cout << "<RAY TRACING DONE>"<< std::endl;
+  return true;
 }
 
-Eigen::Vector3f Flyscene::traceRay(Eigen::Vector3f &origin, Eigen::Vector3f &dest, const int &depth, bool isDebug) {
-	// we limit the amount of bounces the reflected ray can do
-	if (depth > MAX_RECURSIVE_DEPTH) return backgroundColor;
+template <typename Policy>
+Eigen::Vector3f Flyscene::traceRay(const Eigen::Vector3f &origin, const Eigen::Vector3f &dest, int depth) {
+	// The ray being evaluated, carrying the fraction of its light that reaches the camera.
+	// Only reflection spawns a new ray, so at most one bounce is pending at a time
+	Bounce ray(origin, (dest - origin).normalized(), Eigen::Vector3f(1.0, 1.0, 1.0), depth);
 
-	Eigen::Vector3f rayDirection = dest - origin;
-	rayDirection.normalize();
-	
-#ifdef ACCEL_STRUCTURE
-	vector<int> faces = as.intersectAccelStruct(rayDirection, origin);
-	// if the ray did not intersect with a (non-empty) bounding box, return backgroundcolor
-	if (faces.empty()) {
-		if (isDebug)
-			addDebugRay(origin, Eigen::Vector3f(0.0, 0.0, 0.0), rayDirection, Eigen::Vector4f(0.0, 0.0, 0.0, 1.0));
-		return backgroundColor;
-	}
-#endif 
+	Eigen::Vector3f color(0.0, 0.0, 0.0);
+	const int maxDepth = settings.maxRecursiveDepth;
+	RayCounters& counters = RayCounters::local();
 
-	int index = -1;													
-	float minDistance = FLT_MAX;
-	Eigen::Vector3f intersectionPoint;
-
-#ifdef ACCEL_STRUCTURE
-	for (int i = 0; i < faces.size(); ++i) {
-		Tucano::Face face = mesh.getFace(faces[i]);
-#else
-	for (int i = 0; i < mesh.getNumberOfFaces(); ++i) {
-		Tucano::Face face = mesh.getFace(i);
-#endif 
-		
-		float D;
-		Eigen::Vector3f point;
-		
-		/* This method will first check whether the ray intersects with the plane created from the triangle,
-		then check whether D < minDistance to avoid unnecessary computations,
-		and if so return whether the point on the plane lies inside the triangle */
-		if (intersectTriangleNearest(face, rayDirection, origin, point, minDistance, D)) {
-			minDistance = D;
-			index = i;
-			intersectionPoint = point;
+	for (bool pending = true; pending;) {
+		pending = false;
+
+		// we limit the amount of bounces the reflected ray can do
+		if (ray.depth > maxDepth) {
+			color += componentWiseMultiplication(ray.throughput, backgroundColor);
+			continue;
 		}
-	}
+		counters.add(ray.depth > depth ? RayCounters::Reflection : RayCounters::Primary);
 
-	// index >= 0 means we hitted a face so calculate shading and show red debug ray
-	if (index >= 0) {
+		int index;
+		Eigen::Vector3f intersectionPoint;
 
-#ifdef ACCEL_STRUCTURE
-		index = faces[index];
-#endif 
+		// no face hit, so add backgroundcolor and show black, infinite, debug ray
+		if (!intersectNearest<Policy>(ray.origin, ray.direction, index, intersectionPoint)) {
+			if (Policy::debug)
+				addDebugRay(ray.origin, Eigen::Vector3f(0.0, 0.0, 0.0), ray.direction, Eigen::Vector4f(0.0, 0.0, 0.0, 1.0));
+			color += componentWiseMultiplication(ray.throughput, backgroundColor);
+			continue;
+		}
 
-		if (isDebug) {
+		if (Policy::debug) {
 			// reflected ray
-			addDebugRay(origin, intersectionPoint, rayDirection, Eigen::Vector4f(1.0, 0.0, 0.0, 1.0));
+			addDebugRay(ray.origin, intersectionPoint, ray.direction, Eigen::Vector4f(1.0, 0.0, 0.0, 1.0));
 			// surface normal
-			addDebugRay(intersectionPoint, intersectionPoint, mesh.getFace(index).normal.normalized(), Eigen::Vector4f(0.0, 0.0, 0.0, 0.0));
+			addDebugRay(intersectionPoint, intersectionPoint, traceScene().normal(index).normalized(), Eigen::Vector4f(0.0, 0.0, 0.0, 0.0));
 		}
 
-		return calculateShading(mesh.getFace(index), intersectionPoint, rayDirection, depth, isDebug);
-	}
-	// otherwise return backgroundcolor and show black, infinite, debug ray
-	else {
-		if (isDebug) 
-			addDebugRay(origin, intersectionPoint, rayDirection, Eigen::Vector4f(0.0, 0.0, 0.0, 1.0));
+		color += componentWiseMultiplication(ray.throughput, calculateDirectLight<Policy>(index, intersectionPoint, ray.direction));
 
-		return backgroundColor;
+		Bounce reflected;
+		// scenes without reflective materials never look at the material of the hit
+		if (Policy::reflections && materialTable.any(MaterialTable::Reflective) && reflectedBounce(index, intersectionPoint, ray, reflected)) {
+			ray = reflected;
+			pending = true;
+		}
 	}
+	return color;
 }
 
 /*
-Calculate the shading for a given face
+Find the face nearest to the origin that is hit by the ray
+Returns false if no face is hit, otherwise index and intersectionPoint describe the hit
 */
-Eigen::Vector3f Flyscene::calculateShading(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, int depth, bool isDebug) {
-	return calculateDirectLight(face, point, rayDirection, isDebug) + calculateReflectedLight(face, point, rayDirection, depth, isDebug);
+template <typename Policy>
+bool Flyscene::intersectNearest(const Eigen::Vector3f& origin, const Eigen::Vector3f& rayDirection, int& index, Eigen::Vector3f& intersectionPoint) {
+	index = -1;
+	float minDistance = FLT_MAX;
+	const SceneGeometry& scene = traceScene();
+
+	auto testFace = [&](int faceIndex) {
+		float D;
+		Eigen::Vector3f point;
+
+		/* This method will first check whether the ray intersects with the plane created from the triangle,
+		then check whether D < minDistance to avoid unnecessary computations,
+		and if so return whether the point on the plane lies inside the triangle */
+		if (intersectTriangleNearest(faceIndex, rayDirection, origin, point, minDistance, D)) {
+			minDistance = D;
+			index = faceIndex;
+			intersectionPoint = point;
+		}
+	};
+
+	RayCounters& counters = RayCounters::local();
+	if (Policy::accel == AccelBackend::BoundingBoxes) {
+		ScratchVector<int> faces;
+		counters.add(RayCounters::BoxHits, scene.intersectBoxes(rayDirection, origin, faces));
+		for (int i = 0; i < faces.size(); ++i) testFace(faces[i]);
+		counters.add(RayCounters::BoxTests, scene.boxCount);
+		counters.add(RayCounters::TriangleTests, faces.size());
+	}
+	else {
+		for (int i = 0; i < scene.faceCount; ++i) testFace(i);
+		counters.add(RayCounters::TriangleTests, scene.faceCount);
+	}
+	return index >= 0;
 }
 
 /*
 Calculate the direct light for a face 
 */
-Eigen::Vector3f Flyscene::calculateDirectLight(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, bool isDebug) {
-	int material_id = face.material_id;
-	Tucano::Material::Mtl mat = materials[material_id];
-	Eigen::Vector3f result = mat.getAmbient();
-
-	Eigen::Vector3f normal = face.normal;
+template <typename Policy>
+Eigen::Vector3f Flyscene::calculateDirectLight(int face, Eigen::Vector3f point, Eigen::Vector3f rayDirection) {
+	const SceneGeometry& scene = traceScene();
+	MaterialId material = scene.material(face);
+	Eigen::Vector3f result = materialTable.ambient[material];
+	const Eigen::Vector3f& diffuseColor = materialTable.diffuse[material];
+	const Eigen::Vector3f& specularColor = materialTable.specular[material];
+	float shininess = materialTable.shininess[material];
+	bool specularHighlight = materialTable.is(material, MaterialTable::Specular);
+
+	Eigen::Vector3f normal = scene.normal(face);
 	normal.normalize();
 
-	for (int i = 0; i < lights.size(); i++) {
-		float shadowFactor = 0.0f;
-		SphereLight l = lights[i];
-		vector<Eigen::Vector3f> points = l.getSamplingPoints();
+	const LightArrays& l = renderLights;
+	for (int i = 0; i < l.size(); i++) {
+		// without shadows every point is fully lit
+		float shadowFactor = Policy::shadows ? 0.0f : 1.0f;
+		const Eigen::Vector3f* points = l.samples(i);
+		int samples = l.sampleCount(i);
 
-		for (int j = 0; j < points.size(); j++) {
-			Eigen::Vector3f lightPosition = points[j];
+		for (int j = 0; Policy::shadows && j < samples; j++) {
+			const Eigen::Vector3f& lightPosition = points[j];
 			Eigen::Vector3f lightRayDirection = lightPosition - point;
 			float pointLightDistance = lightRayDirection.norm();
 			lightRayDirection.normalize();
-			if (!inShadow(point, normal, lightRayDirection, pointLightDistance)) 
-				shadowFactor += (1.0f / ((float) points.size()));
-			if (isDebug) 
+			if (!inShadow<Policy>(point, normal, lightRayDirection, pointLightDistance, i, j)) 
+				shadowFactor += (1.0f / ((float) samples));
+			if (Policy::debug) 
 				addDebugRay(point, lightPosition, lightRayDirection, Eigen::Vector4f(0.0, 1.0, 0.0, 1.0), true);
 		}
 
-		Eigen::Vector3f lightPosition = l.getLightPosition();
+		// a light hidden from every sampling point adds nothing
+		if (shadowFactor == 0.0f) continue;
+		const Eigen::Vector3f& lightPosition = l.positions[i];
 		Eigen::Vector3f lightRayDirection = lightPosition - point;
 		lightRayDirection.normalize();
-		Eigen::Vector3f lightRayReflection = reflect(-lightRayDirection, normal);
-		Eigen::Vector3f diffuse = (mat.getDiffuse() * max(lightRayDirection.dot(normal), 0.0f));
-		Eigen::Vector3f specular = (mat.getSpecular() * max(pow(lightRayReflection.dot(rayDirection), mat.getShininess()), 0.0f));
-		result += componentWiseMultiplication(diffuse + specular, l.getLightColor()) * shadowFactor;
+		Eigen::Vector3f shading = (diffuseColor * max(lightRayDirection.dot(normal), 0.0f));
+		if (specularHighlight) {
+			Eigen::Vector3f lightRayReflection = reflect(-lightRayDirection, normal);
+			shading += (specularColor * max(pow(lightRayReflection.dot(rayDirection), shininess), 0.0f));
+		}
+		result += componentWiseMultiplication(shading, l.colors[i]) * shadowFactor;
 	}
 	return result;
 }
 
 /*
-Calculate reflected light for a face
+Create the ray reflected by a face, with the throughput of the incoming ray attenuated by the material
+Returns false if the material does not reflect
 */
-Eigen::Vector3f Flyscene::calculateReflectedLight(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, int depth, bool isDebug) {
-	Tucano::Material::Mtl mat = materials[face.material_id];
-	// Material type 3: Reflection on and Ray trace on
-	// Source http://paulbourke.net/dataformats/mtl/
-	if (mat.getIlluminationModel() == 3) {
-		Eigen::Vector3f reflectedRay = reflect(rayDirection, face.normal);
-		Eigen::Vector3f dest = reflectedRay + point;
-		return componentWiseMultiplication(traceRay(point, dest, depth + 1, isDebug), mat.getSpecular());
-	}
-	else
-		return Eigen::Vector3f(0.0, 0.0, 0.0);
+bool Flyscene::reflectedBounce(int face, const Eigen::Vector3f& point, const Bounce& ray, Bounce& reflected) {
+	const SceneGeometry& scene = traceScene();
+	MaterialId material = scene.material(face);
+	if (!materialTable.is(material, MaterialTable::Reflective)) return false;
+
+	Eigen::Vector3f reflectedRay = reflect(ray.direction, scene.normal(face));
+	reflected = Bounce(point, reflectedRay.normalized(), componentWiseMultiplication(ray.throughput, materialTable.reflectivity[material]), ray.depth + 1);
+	return true;
 }
 
 /*
 Decide whether a point is in shadow (true) or lit (false)
 */
-bool Flyscene::inShadow(Eigen::Vector3f point, Eigen::Vector3f normal, Eigen::Vector3f lightRayDirection, float pointLightDistance) {
+template <typename Policy>
+bool Flyscene::inShadow(Eigen::Vector3f point, Eigen::Vector3f normal, Eigen::Vector3f lightRayDirection, float pointLightDistance, int lightIndex, int sampleIndex) {
 	// check if the face is a back face w.r.t. to light direction
 	// we check for < 0 -> angle between 90 and -90 
 	// on the right side of the unitary circle
@@ -444,29 +1084,71 @@ bool Flyscene::inShadow(Eigen::Vector3f point, Eigen::Vector3f normal, Eigen::Ve
 	float epsilon = 0.00001;
 	Eigen::Vector3f lightRayOrigin = point + epsilon * lightRayDirection;
 
+	const SceneGeometry& scene = traceScene();
+	RayCounters& counters = RayCounters::local();
+	counters.add(RayCounters::Shadow);
+
+	// first test the triangle that blocked this light sample last time
+	ShadowCache& cache = ShadowCache::local();
+	int cachedFace = cache.lookup(lightIndex, sampleIndex);
+	if (cachedFace >= 0) {
+		counters.add(RayCounters::TriangleTests);
+		float D;
+		Eigen::Vector3f point2;
+		if (intersectTriangleNearest(cachedFace, lightRayDirection, lightRayOrigin, point2, pointLightDistance, D)) {
+			cache.recordHit();
+			return true;
+		}
+	}
+
 	//Check whether there is an object that intersects with the lightRay (within the given distance, otherwise it is behind the light)
-#ifdef ACCEL_STRUCTURE
-	vector<int> faces = as.intersectAccelStruct(lightRayDirection, lightRayOrigin);
-	for (int i = 0; i < faces.size(); ++i) {
-		Tucano::Face otherFace = mesh.getFace(faces[i]);
-#else
-	for (int i = 0; i < mesh.getNumberOfFaces(); ++i) {
-		Tucano::Face otherFace = mesh.getFace(i);
-#endif
+	auto blocks = [&](int faceIndex) {
 		float D;
 		Eigen::Vector3f point2;
-		if (intersectTriangleNearest(otherFace, lightRayDirection, lightRayOrigin, point2, pointLightDistance, D)) return true;
+		return intersectTriangleNearest(faceIndex, lightRayDirection, lightRayOrigin, point2, pointLightDistance, D);
+	};
+
+	if (Policy::accel == AccelBackend::BoundingBoxes) {
+		ScratchVector<int> faces;
+		counters.add(RayCounters::BoxHits, scene.intersectBoxes(lightRayDirection, lightRayOrigin, faces));
+		counters.add(RayCounters::BoxTests, scene.boxCount);
+		for (int i = 0; i < faces.size(); ++i) {
+			if (blocks(faces[i])) {
+				counters.add(RayCounters::TriangleTests, i + 1);
+				cache.store(lightIndex, sampleIndex, faces[i]);
+				return true;
+			}
+		}
+		counters.add(RayCounters::TriangleTests, faces.size());
+	}
+	else {
+		for (int i = 0; i < scene.faceCount; ++i) {
+			if (blocks(i)) {
+				counters.add(RayCounters::TriangleTests, i + 1);
+				cache.store(lightIndex, sampleIndex, i);
+				return true;
+			}
+		}
+		counters.add(RayCounters::TriangleTests, scene.faceCount);
 	}
 	return false;
 }
 
+/*
+The scene copy of the node the calling render thread runs on, the shared one otherwise
+*/
+const SceneGeometry& Flyscene::traceScene() {
+	return nodeScene != nullptr ? *nodeScene : geometry;
+}
+
 /*
 Check whether a ray intersects with the plane laying onto the face
 Also calculates v0, D and t, which can be used in other methods
 */
-bool Flyscene::intersectPlane(Tucano::Face face, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& v0, float& D, float& t) {
+bool Flyscene::intersectPlane(int face, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& v0, float& D, float& t) {
+	const SceneGeometry& scene = traceScene();
 	// normal is in opposite direction, multiply by -1
-	Eigen::Vector3f normal = -face.normal;
+	Eigen::Vector3f normal = -scene.normal(face);
 	normal.normalize();
 	
 	// if denominator is zero the ray is parallel to the plane, use <= instead of != so we also check whether we are on the right side of the face
@@ -474,7 +1156,7 @@ bool Flyscene::intersectPlane(Tucano::Face face, Eigen::Vector3f rayDirection, E
 	if (denominator <= 0.0f) return false;
 	
 	// calculate the distance and the angle between the ray and the normal of the plane, using one of the vertices
-	v0 = (mesh.getShapeModelMatrix() * mesh.getVertex(face.vertex_ids[0])).head<3>();
+	v0 = scene.vertex(face, 0);
 	D = normal.dot(v0);
 	t = (D - normal.dot(origin)) / denominator;
 
@@ -485,15 +1167,15 @@ bool Flyscene::intersectPlane(Tucano::Face face, Eigen::Vector3f rayDirection, E
 Check whether the ray intersects with the given triangle AND the triangle is maximum minDistance away
 Also calculates D and (the intersection) point, which can be used in other methods
 */
-bool Flyscene::intersectTriangleNearest(Tucano::Face triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& point, float maxDistance, float& D) {
+bool Flyscene::intersectTriangleNearest(int triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& point, float maxDistance, float& D) {
 	float t;
 	Eigen::Vector3f v0;
 
 	if (intersectPlane(triangle, rayDirection, origin, v0, D, t)) {
 		if (D < maxDistance) {
 			point = origin + t * rayDirection;
-			Eigen::Vector3f v1 = (mesh.getShapeModelMatrix() * mesh.getVertex(triangle.vertex_ids[1])).head<3>();
-			Eigen::Vector3f v2 = (mesh.getShapeModelMatrix() * mesh.getVertex(triangle.vertex_ids[2])).head<3>();
+			Eigen::Vector3f v1 = traceScene().vertex(triangle, 1);
+			Eigen::Vector3f v2 = traceScene().vertex(triangle, 2);
 			return pointInTriangle(v0, v1, v2, point);
 		}
 	}
@@ -503,14 +1185,14 @@ bool Flyscene::intersectTriangleNearest(Tucano::Face triangle, Eigen::Vector3f r
 /*
 Check whether the ray intersects with the given triangle
 */
-bool Flyscene::intersectTriangle(Tucano::Face triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin) {
+bool Flyscene::intersectTriangle(int triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin) {
 	float D, t;
 	Eigen::Vector3f normal, v0;
 
 	if (intersectPlane(triangle, rayDirection, origin, v0, D, t)) {
 		Eigen::Vector3f point = origin + t * rayDirection;
-		Eigen::Vector3f v1 = (mesh.getShapeModelMatrix() * mesh.getVertex(triangle.vertex_ids[1])).head<3>();
-		Eigen::Vector3f v2 = (mesh.getShapeModelMatrix() * mesh.getVertex(triangle.vertex_ids[2])).head<3>();
+		Eigen::Vector3f v1 = traceScene().vertex(triangle, 1);
+		Eigen::Vector3f v2 = traceScene().vertex(triangle, 2);
 		return pointInTriangle(v0, v1, v2, point);
 	}
 	return false;
@@ -567,31 +1249,53 @@ Eigen::Vector3f Flyscene::componentWiseMultiplication(Eigen::Vector3f A, Eigen::
 }
 
 /*
-Method used to compute anti-aliasing by averaging a 2x2 pixel block into a single pixel
-Generate smoother image but cut the resolution in half.
+Write the image as a plain text PPM file (same output as Tucano::ImageImporter::writePPMImage)
+The text of every row is formatted in parallel, only writing the file is sequential
 */
-vector<vector<Eigen::Vector3f>> Flyscene::superSampling(vector<vector<Eigen::Vector3f>> pixel_data) {
-	int newWidth = pixel_data[0].size()/2;
-	int newheight = pixel_data[1].size()/2;
-	vector<vector<Eigen::Vector3f>> output;
-
-	output.resize(newheight);
-	for (int i = 0; i < newheight; ++i) 
-		output[i].resize(newWidth);
-
-	for (int i = 0; i < newWidth; i++) {
-		for (int j = 0; j < newheight; j++) {
-			output[i][j] = (pixel_data[(i * 2)][(j * 2)] + pixel_data[(i * 2)][(j * 2) + 1] 
-				+ pixel_data[(i * 2) + 1][(j * 2)] + pixel_data[(i * 2) + 1][(j * 2) + 1]) / 4;
+void Flyscene::writePPMImage(const string& filename, const ImageBuffer& frame) {
+	MemoryTracker::Scope scope(MemoryTracker::Framebuffer);
+	int width = frame.getWidth();
+	int height = frame.getHeight();
+
+	vector<string> rows(height);
+	pool->parallelFor(0, height, [&](int j) {
+		std::ostringstream row;
+		ImageBuffer::Row pixels = frame.row(j);
+		for (int i = 0; i < width; ++i) {
+			row << min(255, (int)(255 * pixels[i][0])) << " " << min(255, (int)(255 * pixels[i][1])) << " " << min(255, (int)(255 * pixels[i][2])) << " ";
 		}
+		row << "\n";
+		rows[j] = row.str();
+	});
+
+	ofstream out_stream(filename.c_str());
+	out_stream << "P3\n";
+	out_stream << width << " " << height << "\n";
+	out_stream << "255\n";
+	for (int j = 0; j < height; ++j)
+		out_stream << rows[j];
+	out_stream.close();
+}
+
+void Flyscene::writeCostImages(const CostImages& costs) {
+	MemoryTracker::Scope scope(MemoryTracker::Framebuffer);
+	ImageBuffer image(costs.getWidth(), costs.getHeight(), settings.tileSize);
+	std::cout << "Cost images (black = 0, red = maximum):";
+	for (int k = 0; k < CostImages::KindCount; ++k) {
+		CostImages::Kind kind = (CostImages::Kind)k;
+		string filename = string("result_") + CostImages::name(kind) + ".ppm";
+		costs.colorize(kind, image);
+		writePPMImage(filename, image);
+		std::cout << " " << filename << " (maximum " << costs.maximum(kind) << ")";
 	}
-	return output;
+	std::cout << std::endl;
 }
 
 /*
 Generate and add a debug ray to the debugRay vector
 */
 void Flyscene::addDebugRay(Eigen::Vector3f origin, Eigen::Vector3f destination, Eigen::Vector3f direction, Eigen::Vector4f color, bool toLight) {
+	MemoryTracker::Scope scope(MemoryTracker::Viewer);
 	float length;
 	bool isNormal = false;
 
@@ -18,18 +18,48 @@
 #include "box.hpp"
 #include "PointLight.hpp"
 #include "AccelerationStructure.hpp"
-
-#define MAX_RECURSIVE_DEPTH 2
-#define MAX_FACES_PER_BOX 50
-#define MAX_OVERLAP 0.2
-#define SUPERSAMPLING
-//#define MULTITHREADING 
-#define ACCEL_STRUCTURE
+#include "ShadowCache.hpp"
+#include "RayCounters.hpp"
+#include "ScratchArena.hpp"
+#include "AllocationCounter.hpp"
+#include "MemoryTracker.hpp"
+#include "TracePolicy.hpp"
+#include "RenderSettings.hpp"
+#include "TileScheduler.hpp"
+#include "ThreadPool.hpp"
+#include "RenderJob.hpp"
+#include "TaskGraph.hpp"
+#include "ObjLoader.hpp"
+#include "PlyLoader.hpp"
+#include "ImageBuffer.hpp"
+#include "CostImages.hpp"
+#include "LightArrays.hpp"
+#include "MaterialTable.hpp"
+#include "SceneBuffers.hpp"
+#include "SceneGeometry.hpp"
+#include "RtScene.hpp"
+#include <memory>
+
+/*
+A ray waiting to be traced, together with the fraction of its light that reaches the camera
+*/
+struct Bounce {
+  Eigen::Vector3f origin;
+  Eigen::Vector3f direction;
+  Eigen::Vector3f throughput;
+  int depth;
+
+  Bounce() {}
+  Bounce(const Eigen::Vector3f& _origin, const Eigen::Vector3f& _direction, const Eigen::Vector3f& _throughput, int _depth)
+    : origin(_origin), direction(_direction), throughput(_throughput), depth(_depth) {}
+};
 
 class Flyscene {
 
 public:
   Flyscene(void) {}
+
+  Flyscene(const RenderSettings& _settings) : settings(_settings), traceVariant(_settings.kernel) {}
   
   /**
    * @brief Initializes the shader effect
@@ -87,20 +117,75 @@ public:
   void highlightRay();
 
   /**
-   * @brief Raytrace your scene from current camera position  
+   * @brief Raytrace your scene from current camera position and wait until it is done
    */
   void raytraceScene(int width = 0, int height = 0);
 
   /**
-   * @brief Trace a single ray from the camera passing through dest
+   * @brief Start ray tracing the scene from the current camera position in the background,
+   * cancelling a render that is still running. When the camera moves before the render is done
+   * it is restarted from the new position (see paintGL)
+   * @param onComplete Called on the render thread when the job finished or was cancelled
+   * @return handle to query the progress and to cancel the render
+   */
+  std::shared_ptr<RenderJob> startRender(int width = 0, int height = 0, RenderJob::Callback onComplete = RenderJob::Callback());
+
+  /**
+   * @brief Cancel the background render (if any) and wait until it has stopped if it was already running,
+   * a render still queued behind the scene build is skipped without waiting for it
+   */
+  void cancelRender();
+
+  /**
+   * @brief The last started render job, nullptr if nothing was rendered yet
+   */
+  std::shared_ptr<RenderJob> getRenderJob() { return renderJob; }
+
+  /**
+   * @brief Raytrace the scene once with every compiled kernel variant and compare the trace times
+   */
+  void benchmarkVariants(int width = 0, int height = 0);
+
+  /**
+   * @brief Load the configured and the largest shipped OBJ and PLY files with the Tucano importer
+   * (rply callbacks for PLY) and with our loaders, and print the throughput of both
+   */
+  void benchmarkLoaders();
+
+  /**
+   * @brief Compare the memory per face and the ray-triangle test throughput of the packed
+   * index and material arrays the tracer reads with Tucano::Face, which it used to copy per test
+   */
+  void benchmarkFaceLayout();
+
+  /**
+   * @brief Block until the scene is loaded and its acceleration structure is built
+   * (and written to settings.compileScene when compiling)
+   */
+  void waitForScene();
+
+  /**
+   * @brief Select the kernel used by raytraceScene
+   */
+  void setTraceVariant(TraceVariant variant) { traceVariant = variant; }
+
+  /**
+   * @brief Trace a single ray from the camera passing through dest,
+   * following its reflections iteratively up to settings.maxRecursiveDepth
    * @param origin Ray origin
    * @param dest Other point on the ray, usually screen coordinates
+   * @param depth Number of bounces the ray already made
+   * @tparam Policy TracePolicy selecting debug recording, acceleration and shading features
    * @return a RGB color
    */
-  Eigen::Vector3f traceRay(Eigen::Vector3f& origin, Eigen::Vector3f& dest, const int& depth, bool isDebug);
+  template <typename Policy>
+  Eigen::Vector3f traceRay(const Eigen::Vector3f& origin, const Eigen::Vector3f& dest, int depth);
 
 
 private:
+  // Tuning parameters, fixed for the lifetime of the scene
+  const RenderSettings settings;
+
   // A simple phong shader for rendering meshes
   Tucano::Effects::PhongMaterial phong;
 
@@ -117,10 +202,13 @@ private:
   // Scene light represented as a camera
   Tucano::Camera scene_light;
 
-  // List containing all lights for raytracing
+  // The lights as drawn in the 3D view
   // The phong shading for the 3D view only considers the last light
   vector<SphereLight> lights;
 
+  // The same lights for raytracing, kept in sync with lights by addSceneLight and clearLights
+  LightArrays renderLights;
+
   // List containing all samplingPoints that will be used for calculating the soft shadows
   vector<SphereLight> samplingPoints;
 
@@ -129,6 +217,9 @@ private:
 
   /// MTL materials
   vector<Tucano::Material::Mtl> materials;
+
+  // The materials compiled for the tracer
+  MaterialTable materialTable;
   
   // List containing all (cylinders representing) debug rays
   vector<Tucano::Shapes::Cylinder> debugRays;
@@ -139,12 +230,45 @@ private:
   // List containing all (cylinder representing) debug rays to the light
   vector<Tucano::Shapes::Cylinder> lightDebugRays;
 
-  // Structure used to accelerate ray tracing
-  AccelerationStructure as;
+  // Worker threads shared by everything that runs in parallel, created in initialize
+  std::unique_ptr<ThreadPool> pool;
+
+  // Single thread running the render jobs, it hands the tiles to the pool and writes the image
+  // (it also builds the acceleration structure at startup, so renders queue up behind it)
+  std::unique_ptr<ThreadPool> renderThread;
+
+  // Tasks loading the scene, kept alive until the last of them has finished
+  std::unique_ptr<TaskGraph> startup;
+
+  // Becomes ready when the acceleration structure has been built
+  std::shared_future<void> sceneReady;
+
+  // Current background render, with the camera view, size and callback it was started with
+  std::shared_ptr<RenderJob> renderJob;
+  Eigen::Matrix4f renderView;
+  Eigen::Vector2i renderSize;
+  RenderJob::Callback renderCallback;
+
+  // Triangles and acceleration structure boxes the tracer reads, they live either in sceneBuffers
+  // or in the mapped sceneFile (which may leave the boxes to sceneBuffers)
+  SceneGeometry geometry;
+  SceneBuffers sceneBuffers;
+  RtScene sceneFile;
+
+  // Out of core (settings.pageCacheMb): the faces are read from the page file, only the boxes stay in memory
+  GeometryPages pages;
+  vector<GeometryBox> pagedBoxes;
+
+  // NUMA mode: a copy of the geometry per node, made on that node
+  vector<std::unique_ptr<SceneBuffers>> nodeBuffers;
+  vector<SceneGeometry> nodeScenes;
 
   // Default background color of the scene
   Eigen::Vector3f backgroundColor = Eigen::Vector3f(0.7, 0.7, 0.7);
 
+  // Kernel used by raytraceScene
+  TraceVariant traceVariant = TraceVariant::Production;
+
   // Indicates whether the bounding boxes will be displayed in the 3D scene
   bool displayBoundingBoxes = true;
 
@@ -154,19 +278,61 @@ private:
   // original color of highlighted ray
   Eigen::Vector4f lastColor;
 
-  Eigen::Vector3f calculateShading(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, int depth, bool isDebug);
+  // Render with the kernel of the given variant, returns false when the job was cancelled
+  bool renderVariant(TraceVariant variant, Tucano::Camera& camera, int width, int height, RenderJob& job);
+
+  template <typename Policy>
+  bool renderScene(Tucano::Camera& camera, int width, int height, RenderJob& job);
+
+  // True once the acceleration structure is built (without waiting for it)
+  bool sceneLoaded();
+
+  // Add a light to the viewer and to the lights the tracer reads
+  void addSceneLight(const SphereLight& light);
+
+  // Weld, clean up and sort the triangles of a loaded file (preprocess_geometry)
+  void preprocessScene();
+
+  // Whether the scene is stored in the compact mode (quantize_vertices)
+  bool quantizing() const;
+
+  // Compact mode: replace the vertex positions and face normals by their 16-bit encodings
+  void quantizeScene();
+
+  // Build the acceleration structure over the triangles of the geometry and point the geometry at its boxes
+  void buildAccelerationStructure();
+
+  // Out of core: write the faces to the page file and trace from it, freeing the triangles in memory
+  void pageScene();
+
+  // NUMA mode: copy the geometry to every node
+  void replicateScene();
+
+  // Write the loaded OBJ scene to settings.compileScene
+  void writeCompiledScene(const ObjData& obj);
+
+  // Write the false color images of the per pixel costs of a render (cost_images)
+  void writeCostImages(const CostImages& costs);
+
+  // Geometry used by the calling thread (its node's copy in NUMA mode)
+  const SceneGeometry& traceScene();
+
+  template <typename Policy>
+  bool intersectNearest(const Eigen::Vector3f& origin, const Eigen::Vector3f& rayDirection, int& index, Eigen::Vector3f& intersectionPoint);
 
-  Eigen::Vector3f calculateDirectLight(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, bool isDebug);
+  template <typename Policy>
+  Eigen::Vector3f calculateDirectLight(int face, Eigen::Vector3f point, Eigen::Vector3f rayDirection);
 
-  Eigen::Vector3f calculateReflectedLight(Tucano::Face face, Eigen::Vector3f point, Eigen::Vector3f rayDirection, int depth, bool isDebug);
+  bool reflectedBounce(int face, const Eigen::Vector3f& point, const Bounce& ray, Bounce& reflected);
 
-  bool inShadow(Eigen::Vector3f intersectionPoint, Eigen::Vector3f normal, Eigen::Vector3f lightRayDirection, float pointLightDistance);
+  template <typename Policy>
+  bool inShadow(Eigen::Vector3f intersectionPoint, Eigen::Vector3f normal, Eigen::Vector3f lightRayDirection, float pointLightDistance, int lightIndex, int sampleIndex);
 
-  bool intersectPlane(Tucano::Face face, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& v0, float& D, float& t);
+  bool intersectPlane(int face, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& v0, float& D, float& t);
 
-  bool intersectTriangleNearest(Tucano::Face triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& point, float maxDistance, float& D);
+  bool intersectTriangleNearest(int triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin, Eigen::Vector3f& point, float maxDistance, float& D);
 
-  bool intersectTriangle(Tucano::Face triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin);
+  bool intersectTriangle(int triangle, Eigen::Vector3f rayDirection, Eigen::Vector3f origin);
 
   bool pointInTriangle(Eigen::Vector3f v0, Eigen::Vector3f v1, Eigen::Vector3f v2, Eigen::Vector3f p);
 
@@ -176,7 +342,7 @@ private:
 
   Eigen::Vector3f componentWiseMultiplication(Eigen::Vector3f A, Eigen::Vector3f B);
 
-  vector<vector<Eigen::Vector3f>> superSampling(vector<vector<Eigen::Vector3f>> pixel_data);
+  void writePPMImage(const string& filename, const ImageBuffer& frame);
 
   void addDebugRay(Eigen::Vector3f origin, Eigen::Vector3f destination, Eigen::Vector3f direction, Eigen::Vector4f color, bool toLight = false);
 
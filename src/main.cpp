@@ -3,12 +3,26 @@
 
 #include <GLFW/glfw3.h>
 #include "flyscene.hpp"
+#include "AllocationCounter.hpp"
+#include "MemoryTracker.hpp"
 #include <iostream>
+#include <cstdlib>
+#include <new>
 
 #define WINDOW_WIDTH 300
 #define WINDOW_HEIGHT 300
 
+// Replace the global allocation functions so heap allocations can be counted and attributed to a subsystem
+void* operator new(std::size_t size) {
+	AllocationCounter::increment();
+	return MemoryTracker::allocate(size);
+}
+
+void operator delete(void* p) noexcept { MemoryTracker::release(p); }
+void operator delete(void* p, std::size_t) noexcept { MemoryTracker::release(p); }
+
 Flyscene *flyscene;
+RenderSettings settings;
 Eigen::Vector2f mouse_pos = Eigen::Vector2f::Zero();
 
 #ifdef TUCANODEBUG
@@ -37,7 +51,7 @@ void initialize(void) {
   glDebugMessageCallback(MessageCallback, 0);
 #endif
 
-  flyscene = new Flyscene();
+  flyscene = new Flyscene(settings);
   flyscene->initialize(WINDOW_WIDTH, WINDOW_HEIGHT);  
 
   std::cout << endl
@@ -52,7 +66,11 @@ void initialize(void) {
   std::cout << "F    : Remove all lights sources from the scene" << std::endl;
   std::cout << "B    : Change background color" << std::endl;
   std::cout << "N    : Toggle ON/OFF bounding boxes" << std::endl;
-  std::cout << "T    : Ray trace the scene" << std::endl;
+  std::cout << "T    : Ray trace the scene in the background" << std::endl;
+  std::cout << "X    : Cancel the ray tracing" << std::endl;
+  std::cout << "V    : Benchmark all ray tracing kernel variants" << std::endl;
+  std::cout << "O    : Benchmark the OBJ and PLY loaders" << std::endl;
+  std::cout << "G    : Benchmark the face layout" << std::endl;
   std::cout << "Esc  : Close application" << std::endl;
   std::cout << " ********************************* " << std::endl;
 }
@@ -70,7 +88,18 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action,
   else if (key == GLFW_KEY_L && action == GLFW_PRESS)
 	  flyscene->addLight();
   else if (key == GLFW_KEY_T && action == GLFW_PRESS)
-	  flyscene->raytraceScene();
+	  flyscene->startRender(0, 0, [](RenderJob& job) {
+		  // runs on the render thread, the window title is updated by the main loop
+		  if (job.state() == RenderJob::State::Finished) std::cout << "Ray traced image written to result.ppm" << std::endl;
+	  });
+  else if (key == GLFW_KEY_X && action == GLFW_PRESS)
+	  flyscene->cancelRender();
+  else if (key == GLFW_KEY_V && action == GLFW_PRESS)
+	  flyscene->benchmarkVariants();
+  else if (key == GLFW_KEY_O && action == GLFW_PRESS)
+	  flyscene->benchmarkLoaders();
+  else if (key == GLFW_KEY_G && action == GLFW_PRESS)
+	  flyscene->benchmarkFaceLayout();
   else if (key == GLFW_KEY_B && action == GLFW_PRESS)
 	  flyscene->changeBackground();
   else if (key == GLFW_KEY_N && action == GLFW_PRESS)
@@ -79,6 +108,18 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action,
 	  flyscene->clearLights();
 }
 
+/*
+Show the progress of the background render in the window title
+*/
+void updateTitle(GLFWwindow *window) {
+  static std::string title;
+  std::shared_ptr<RenderJob> job = flyscene->getRenderJob();
+  std::string newTitle = "Ray Tracer";
+  if (job && job->running())
+	  newTitle += " - ray tracing " + std::to_string((int)(job->progress() * 100)) + "%";
+  if (newTitle != title) glfwSetWindowTitle(window, (title = newTitle).c_str());
+}
+
 static void mouseButtonCallback(GLFWwindow *window, int button, int action,
                                 int mods) {
   if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
@@ -99,6 +140,10 @@ static void cursorPosCallback(GLFWwindow *window, double xpos, double ypos) {
 int main(int argc, char *argv[]) {
   GLFWwindow *main_window;
 
+  // settings from render.cfg (if present) can be overridden with --key=value arguments
+  settings.loadFile("render.cfg");
+  settings.parseCommandLine(argc, argv);
+
   if (!glfwInit()) {
     std::cerr << "Failed to init glfw" << std::endl;
     return 1;
@@ -126,6 +171,14 @@ int main(int argc, char *argv[]) {
 
   initialize();
 
+  // offline compile step: wait until the scene is written and exit without showing it
+  if (!settings.compileScene.empty()) {
+	  flyscene->waitForScene();
+	  glfwDestroyWindow(main_window);
+	  glfwTerminate();
+	  return 0;
+  }
+
   while (!glfwWindowShouldClose(main_window)) {
     glfwMakeContextCurrent(main_window);
     flyscene->paintGL();
@@ -133,8 +186,13 @@ int main(int argc, char *argv[]) {
 
     glfwPollEvents();
     flyscene->simulate(main_window);
+    updateTitle(main_window);
   }
 
+  // let a running render stop before the window (and process) goes away, also one still queued
+  flyscene->cancelRender();
+  if (flyscene->getRenderJob()) flyscene->getRenderJob()->wait();
+
   glfwDestroyWindow(main_window);
   glfwTerminate();
   return 0;